@@ -8,11 +8,16 @@
 
 #define _USE_MATH_DEFINES
 #include <stdio.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <math.h>
+#include <string.h>
+#include <time.h>
 #include <vector>
 
-#if defined(__APPLE__)
+#if defined(GALAXY_HEADLESS)
+#include "nullgl.h"         // no window or GL context: simulation only
+#elif defined(__APPLE__)
 #include <GLUT/GLUT.h>
 #include <OpenGL/gl3.h>
 #include <OpenGL/glu.h>
@@ -25,8 +30,21 @@
 #endif
 
 #include <string>
+#include <map>
+#include <chrono>
+#include <algorithm>
+#include <new>
+#include <type_traits>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 
 const unsigned int windowWidth = 512, windowHeight = 512;
+int viewportWidth = windowWidth, viewportHeight = windowHeight; // follows reshapes
 
 // OpenGL major and minor versions
 int majorVersion = 3, minorVersion = 0;
@@ -48,7 +66,7 @@ public:
         m[3][0] = m30; m[3][1] = m31; m[3][2] = m32; m[3][3] = m33;
     }
     
-    mat4 operator*(const mat4& right)
+    mat4 operator*(const mat4& right) const
     {
         mat4 result;
         for (int i = 0; i < 4; i++)
@@ -75,7 +93,7 @@ struct vec4
         v[0] = x; v[1] = y; v[2] = z; v[3] = w;
     }
     
-    vec4 operator*(const mat4& mat)
+    vec4 operator*(const mat4& mat) const
     {
         vec4 result;
         for (int j = 0; j < 4; j++)
@@ -119,6 +137,723 @@ struct vec2
 };
 
 
+// shadow copy of the GL state the renderer changes, so binds and toggles that
+// would not change anything never reach the driver; everything that binds a
+// program, vertex array or texture, or touches blending, goes through here
+class RenderState {
+    static const int textureUnits = 16;
+    
+    unsigned int program;
+    unsigned int vertexArray;
+    unsigned int activeUnit;
+    unsigned int textures[textureUnits];
+    int blend; // -1 until first set
+    unsigned int blendSrc, blendDst, blendSrcAlpha, blendDstAlpha;
+    
+    int issued, elided;
+    int issuedLastFrame, elidedLastFrame;
+    int issuedTotal, elidedTotal;
+    
+    bool Change(bool changed) {
+        if (changed) issued++;
+        else elided++;
+        return changed;
+    }
+    
+public:
+    RenderState() {
+        program = 0;
+        vertexArray = 0;
+        activeUnit = 0;
+        for (int i = 0; i < textureUnits; i++) textures[i] = 0;
+        blend = -1;
+        blendSrc = blendDst = blendSrcAlpha = blendDstAlpha = 0;
+        issued = elided = 0;
+        issuedLastFrame = elidedLastFrame = 0;
+        issuedTotal = elidedTotal = 0;
+    }
+    
+    void UseProgram(unsigned int p) {
+        if (Change(p != program)) glUseProgram(program = p);
+    }
+    
+    void BindVertexArray(unsigned int vao) {
+        if (Change(vao != vertexArray)) glBindVertexArray(vertexArray = vao);
+    }
+    
+    void ActiveTexture(unsigned int unit) {
+        if (Change(unit != activeUnit)) glActiveTexture(GL_TEXTURE0 + (activeUnit = unit));
+    }
+    
+    // binds to the active unit
+    void BindTexture(unsigned int texture) {
+        if (Change(textures[activeUnit] != texture)) glBindTexture(GL_TEXTURE_2D, textures[activeUnit] = texture);
+    }
+    
+    void Blend(bool enable) {
+        if (Change(blend != (int)enable)) {
+            blend = enable;
+            if (enable) glEnable(GL_BLEND);
+            else glDisable(GL_BLEND);
+        }
+    }
+    
+    void BlendFunc(unsigned int src, unsigned int dst) {
+        BlendFuncSeparate(src, dst, src, dst);
+    }
+    
+    void BlendFuncSeparate(unsigned int src, unsigned int dst, unsigned int srcAlpha, unsigned int dstAlpha) {
+        if (Change(src != blendSrc || dst != blendDst || srcAlpha != blendSrcAlpha || dstAlpha != blendDstAlpha)) {
+            glBlendFuncSeparate(blendSrc = src, blendDst = dst, blendSrcAlpha = srcAlpha, blendDstAlpha = dstAlpha);
+        }
+    }
+    
+    // ordinary alpha blending for color; alpha accumulates coverage, so a
+    // sprite drawn into a transparent texture leaves it premultiplied
+    void SpriteBlend() {
+        Blend(true);
+        BlendFuncSeparate(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA, GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
+    }
+    
+    // GL unbinds deleted objects, and a later object may get the same name
+    void ProgramDeleted(unsigned int p) {if (program == p) program = 0;}
+    void VertexArrayDeleted(unsigned int vao) {if (vertexArray == vao) vertexArray = 0;}
+    void TextureDeleted(unsigned int texture) {
+        for (int i = 0; i < textureUnits; i++) if (textures[i] == texture) textures[i] = 0;
+    }
+    
+    // call once per frame after drawing
+    void EndFrame() {
+        issuedLastFrame = issued;
+        elidedLastFrame = elided;
+        issuedTotal += issued;
+        elidedTotal += elided;
+        issued = elided = 0;
+    }
+    
+    int IssuedLastFrame() {return issuedLastFrame;}
+    int ElidedLastFrame() {return elidedLastFrame;}
+    int IssuedTotal() {return issuedTotal;}
+    int ElidedTotal() {return elidedTotal;}
+};
+
+RenderState renderState;
+
+// part of a texture in texture coordinates: corner (u, v) and size
+struct AtlasRegion {
+    float u, v, width, height;
+};
+
+// scaling, rotation and translation in 2D, the same transform as S * R * T
+// for row vectors: p' = p.x * row0 + p.y * row1 + offset
+struct Affine2D {
+    float row0[2], row1[2], offset[2];
+    
+    // all six in order, as uniforms and instance records want them
+    const float* Floats() const {return reinterpret_cast<const float*>(this);}
+};
+
+inline Affine2D MakeAffine(vec2 position, vec2 scaling, float orientation) {
+    float radians = orientation/180*M_PI;
+    float c = cosf(radians), s = sinf(radians);
+    Affine2D a = {{scaling.x * c, scaling.x * s}, {-scaling.y * s, scaling.y * c}, {position.x, position.y}};
+    return a;
+}
+
+// batched MakeAffine: n sprites from one array per field, affine i written as
+// six floats at out + i * stride; within a few ulp of MakeAffine for angles
+// under a turn, and closer to exact past that since they reduce in degrees
+typedef void (*AffineKernel)(const float* x, const float* y, const float* scalingX, const float* scalingY,
+                             const float* orientation, int n, float* out, int stride);
+
+void AffineKernelScalar(const float* x, const float* y, const float* scalingX, const float* scalingY,
+                        const float* orientation, int n, float* out, int stride) {
+    for (int i = 0; i < n; i++) {
+        Affine2D a = MakeAffine(vec2(x[i], y[i]), vec2(scalingX[i], scalingY[i]), orientation[i]);
+        memcpy(out + i * stride, &a, sizeof(Affine2D));
+    }
+}
+
+// the vector paths share one body written with GCC/Clang vector extensions;
+// each wrapper below compiles it for its own instruction set
+#if defined(__GNUC__)
+typedef float f32x4 __attribute__((vector_size(16)));
+typedef int32_t i32x4 __attribute__((vector_size(16)));
+typedef float f32x8 __attribute__((vector_size(32)));
+typedef int32_t i32x8 __attribute__((vector_size(32)));
+typedef float f32x16 __attribute__((vector_size(64)));
+typedef int32_t i32x16 __attribute__((vector_size(64)));
+
+// sine and cosine of angles in degrees; reducing in degrees is exact, then
+// the Cephes minimax polynomials cover the remaining [-45, 45]
+template<typename F, typename I>
+__attribute__((always_inline)) inline void SinCosDegrees(const F& degrees, F& s, F& c) {
+    F quadrants = degrees * (1.0f / 90);
+    F rounded = (quadrants + 12582912.0f) - 12582912.0f; // 1.5 * 2^23 rounds to nearest
+    I q = __builtin_convertvector(rounded, I);
+    F y = (degrees - rounded * 90) * (float)(M_PI / 180);
+    F z = y * y;
+    
+    F sy = ((-1.9515295891e-4f * z + 8.3321608736e-3f) * z - 1.6666654611e-1f) * z * y + y;
+    F cy = ((2.443315711809948e-5f * z - 1.388731625493765e-3f) * z + 4.166664568298827e-2f) * z * z - 0.5f * z + 1.0f;
+    
+    // odd quadrants swap sine and cosine, then the signs follow the quadrant
+    I swap = (q & 1) != 0;
+    I sBits = ((I)sy & ~swap) | ((I)cy & swap);
+    I cBits = ((I)cy & ~swap) | ((I)sy & swap);
+    s = (F)(sBits ^ ((q & 2) << 30));
+    c = (F)(cBits ^ (((q + 1) & 2) << 30));
+}
+
+template<typename F, typename I>
+__attribute__((always_inline)) inline void AffineKernelVector(const float* x, const float* y, const float* scalingX, const float* scalingY,
+                                                              const float* orientation, int n, float* out, int stride) {
+    const int lanes = sizeof(F) / sizeof(float);
+    for (int first = 0; first < n; first += lanes) {
+        int count = n - first < lanes ? n - first : lanes;
+        F degrees = {}, sx = {}, sy = {};
+        memcpy(&degrees, orientation + first, count * sizeof(float));
+        memcpy(&sx, scalingX + first, count * sizeof(float));
+        memcpy(&sy, scalingY + first, count * sizeof(float));
+        
+        F s, c;
+        SinCosDegrees<F, I>(degrees, s, c);
+        F a = sx * c, b = sx * s, cc = -sy * s, d = sy * c;
+        
+        // the instance buffer interleaves the fields, so scatter lane by lane
+        for (int k = 0; k < count; k++) {
+            float* o = out + (first + k) * stride;
+            o[0] = a[k]; o[1] = b[k];
+            o[2] = cc[k]; o[3] = d[k];
+            o[4] = x[first + k]; o[5] = y[first + k];
+        }
+    }
+}
+
+void AffineKernel128(const float* x, const float* y, const float* scalingX, const float* scalingY,
+                     const float* orientation, int n, float* out, int stride) {
+    AffineKernelVector<f32x4, i32x4>(x, y, scalingX, scalingY, orientation, n, out, stride);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#define GALAXY_X86_KERNELS 1
+
+__attribute__((target("avx2,fma")))
+void AffineKernelAVX2(const float* x, const float* y, const float* scalingX, const float* scalingY,
+                      const float* orientation, int n, float* out, int stride) {
+    AffineKernelVector<f32x8, i32x8>(x, y, scalingX, scalingY, orientation, n, out, stride);
+}
+
+__attribute__((target("avx512f")))
+void AffineKernelAVX512(const float* x, const float* y, const float* scalingX, const float* scalingY,
+                        const float* orientation, int n, float* out, int stride) {
+    AffineKernelVector<f32x16, i32x16>(x, y, scalingX, scalingY, orientation, n, out, stride);
+}
+#endif
+#endif
+
+// every kernel this build and CPU can run, slowest first
+struct AffineKernelEntry {
+    const char* name;
+    AffineKernel kernel;
+};
+
+int AvailableAffineKernels(AffineKernelEntry* entries) {
+    int count = 0;
+    entries[count++] = {"scalar", AffineKernelScalar};
+#if defined(__GNUC__)
+#if defined(GALAXY_X86_KERNELS)
+    entries[count++] = {"sse2", AffineKernel128};
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) entries[count++] = {"avx2", AffineKernelAVX2};
+    if (__builtin_cpu_supports("avx512f")) entries[count++] = {"avx512", AffineKernelAVX512};
+#else
+    entries[count++] = {"128-bit", AffineKernel128};
+#endif
+#endif
+    return count;
+}
+
+// the widest kernel the CPU supports, picked once at startup
+AffineKernelEntry SelectAffineKernel() {
+    AffineKernelEntry entries[4];
+    return entries[AvailableAffineKernels(entries) - 1];
+}
+
+AffineKernelEntry affineKernel = SelectAffineKernel();
+
+// squared closest approach of two points moving in straight lines over the
+// same tick, one from p0 to p1 and the other from q0 to q1: the closest
+// point of their relative motion
+inline float SweptDistance2(float px0, float py0, float px1, float py1, float qx0, float qy0, float qx1, float qy1) {
+    float dx = px0 - qx0, dy = py0 - qy0;
+    float vx = (px1 - px0) - (qx1 - qx0), vy = (py1 - py0) - (qy1 - qy0);
+    float vv = vx*vx + vy*vy;
+    float t = vv > 0 ? -(dx*vx + dy*vy) / vv : 0;
+    t = t < 0 ? 0 : (t > 1 ? 1 : t);
+    dx += vx * t;
+    dy += vy * t;
+    return dx*dx + dy*dy;
+}
+
+inline bool SweptHit(float px0, float py0, float px1, float py1, float qx0, float qy0, float qx1, float qy1, float radius2) {
+    return SweptDistance2(px0, py0, px1, py1, qx0, qy0, qx1, qy1) < radius2;
+}
+
+// batched SweptHit: one shot moving from p0 to p1 against n targets, target
+// i moving from from[i] to to[i]; bit i % 32 of masks[i / 32] is set when
+// target i came within the square root of radius2. The vector kernels do
+// the same operations in the same order; only where the compiler fuses a
+// multiply-add can a closest approach right on the radius round the other way
+typedef void (*NarrowphaseKernel)(float px0, float py0, float px1, float py1,
+                                  const float* fromX, const float* fromY, const float* toX, const float* toY,
+                                  int n, float radius2, uint32_t* masks);
+
+void NarrowphaseKernelScalar(float px0, float py0, float px1, float py1,
+                             const float* fromX, const float* fromY, const float* toX, const float* toY,
+                             int n, float radius2, uint32_t* masks) {
+    memset(masks, 0, (n + 31) / 32 * sizeof(uint32_t));
+    for (int i = 0; i < n; i++) {
+        if (SweptHit(px0, py0, px1, py1, fromX[i], fromY[i], toX[i], toY[i], radius2)) masks[i / 32] |= 1u << (i % 32);
+    }
+}
+
+// index of the lowest set bit of a nonzero mask, for walking the hits in one
+inline int CountTrailingZeros(uint32_t bits) {
+#if defined(__GNUC__)
+    return __builtin_ctz(bits);
+#else
+    int zeros = 0;
+    for (; !(bits & 1); bits >>= 1) zeros++;
+    return zeros;
+#endif
+}
+
+#if defined(__GNUC__)
+// the first count lanes from p, the rest zero; full blocks load in one go
+template<typename F>
+__attribute__((always_inline)) inline void LoadLanes(F& v, const float* p, int count) {
+    if (count == sizeof(F) / sizeof(float)) memcpy(&v, p, sizeof(F));
+    else {
+        v = F{};
+        memcpy(&v, p, count * sizeof(float));
+    }
+}
+
+// bit k set for every lane k of a comparison result that is true
+template<typename I>
+__attribute__((always_inline)) inline uint32_t LaneBits(const I& lanes) {
+    uint32_t bits = 0;
+    for (int k = 0; k < sizeof(I) / sizeof(int32_t); k++) bits |= (uint32_t)(lanes[k] & 1) << k;
+    return bits;
+}
+
+// one instruction on x86; the wider ones are inlined once the kernel body
+// lands in a wrapper built for their instruction set
+#if defined(GALAXY_X86_KERNELS)
+inline uint32_t LaneBits(const i32x4& lanes) {return _mm_movemask_ps((__m128)lanes);}
+__attribute__((target("avx"))) inline uint32_t LaneBits(const i32x8& lanes) {return _mm256_movemask_ps((__m256)lanes);}
+__attribute__((target("avx512f"))) inline uint32_t LaneBits(const i32x16& lanes) {return _mm512_test_epi32_mask((__m512i)lanes, (__m512i)lanes);}
+#endif
+
+template<typename F, typename I>
+__attribute__((always_inline)) inline void NarrowphaseKernelVector(float px0, float py0, float px1, float py1,
+                                                                   const float* fromX, const float* fromY, const float* toX, const float* toY,
+                                                                   int n, float radius2, uint32_t* masks) {
+    const int lanes = sizeof(F) / sizeof(float);
+    memset(masks, 0, (n + 31) / 32 * sizeof(uint32_t));
+    F zero = {}, one = zero + 1.0f;
+    for (int first = 0; first < n; first += lanes) {
+        int count = n - first < lanes ? n - first : lanes;
+        F qx0, qy0, qx1, qy1;
+        LoadLanes(qx0, fromX + first, count);
+        LoadLanes(qy0, fromY + first, count);
+        LoadLanes(qx1, toX + first, count);
+        LoadLanes(qy1, toY + first, count);
+        
+        F dx = px0 - qx0, dy = py0 - qy0;
+        F vx = (px1 - px0) - (qx1 - qx0), vy = (py1 - py0) - (qy1 - qy0);
+        F vv = vx*vx + vy*vy;
+        F t = -(dx*vx + dy*vy) / vv;
+        
+        // t is 0 where the relative motion is none, then clamped to [0, 1];
+        // one select at a time, which GCC keeps in AVX-512 mask registers
+        t = (F)((I)t & (vv > zero));
+        t = (F)((I)t & ~(t < zero));
+        I above = t > one;
+        t = (F)(((I)t & ~above) | ((I)one & above));
+        dx += vx * t;
+        dy += vy * t;
+        I hit = dx*dx + dy*dy < radius2;
+        
+        // padding lanes are dropped; lanes never straddle a mask word
+        uint32_t bits = LaneBits(hit);
+        if (count < lanes) bits &= (1u << count) - 1;
+        masks[first / 32] |= bits << (first % 32);
+    }
+}
+
+void NarrowphaseKernel128(float px0, float py0, float px1, float py1,
+                          const float* fromX, const float* fromY, const float* toX, const float* toY,
+                          int n, float radius2, uint32_t* masks) {
+    NarrowphaseKernelVector<f32x4, i32x4>(px0, py0, px1, py1, fromX, fromY, toX, toY, n, radius2, masks);
+}
+
+#if defined(GALAXY_X86_KERNELS)
+// no fma, so this one rounds exactly like the scalar test
+__attribute__((target("avx2")))
+void NarrowphaseKernelAVX2(float px0, float py0, float px1, float py1,
+                           const float* fromX, const float* fromY, const float* toX, const float* toY,
+                           int n, float radius2, uint32_t* masks) {
+    NarrowphaseKernelVector<f32x8, i32x8>(px0, py0, px1, py1, fromX, fromY, toX, toY, n, radius2, masks);
+}
+
+__attribute__((target("avx512f")))
+void NarrowphaseKernelAVX512(float px0, float py0, float px1, float py1,
+                             const float* fromX, const float* fromY, const float* toX, const float* toY,
+                             int n, float radius2, uint32_t* masks) {
+    NarrowphaseKernelVector<f32x16, i32x16>(px0, py0, px1, py1, fromX, fromY, toX, toY, n, radius2, masks);
+}
+#endif
+#endif
+
+struct NarrowphaseKernelEntry {
+    const char* name;
+    NarrowphaseKernel kernel;
+};
+
+// every kernel this build and CPU can run, slowest first
+int AvailableNarrowphaseKernels(NarrowphaseKernelEntry* entries) {
+    int count = 0;
+    entries[count++] = {"scalar", NarrowphaseKernelScalar};
+#if defined(__GNUC__)
+#if defined(GALAXY_X86_KERNELS)
+    entries[count++] = {"sse2", NarrowphaseKernel128};
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) entries[count++] = {"avx2", NarrowphaseKernelAVX2};
+    if (__builtin_cpu_supports("avx512f")) entries[count++] = {"avx512", NarrowphaseKernelAVX512};
+#else
+    entries[count++] = {"128-bit", NarrowphaseKernel128};
+#endif
+#endif
+    return count;
+}
+
+NarrowphaseKernelEntry SelectNarrowphaseKernel() {
+    NarrowphaseKernelEntry entries[4];
+    return entries[AvailableNarrowphaseKernels(entries) - 1];
+}
+
+NarrowphaseKernelEntry narrowphaseKernel = SelectNarrowphaseKernel();
+
+// total GLSL programs compiled so far; see ShaderRegistry::EndFrame
+int shaderCompileCount = 0;
+
+inline void SendUniform(int location, int value) { glUniform1i(location, value); }
+inline void SendUniform(int location, vec4 value) { glUniform3fv(location, 1, &value.v[0]); }
+inline void SendUniform(int location, AtlasRegion value) { glUniform4fv(location, 1, &value.u); }
+inline void SendUniform(int location, Affine2D value) { glUniform2fv(location, 3, value.Floats()); }
+inline void SendUniform(int location, mat4 value) { glUniformMatrix4fv(location, 1, GL_TRUE, value); }
+
+// binding point of the View uniform block every sprite shader declares
+const unsigned int viewBlockBinding = 0;
+
+// the camera's view matrix in a uniform buffer shared by all programs, so
+// it is computed and uploaded once per frame instead of once per sprite
+class ViewBlock {
+    unsigned int ubo;
+    bool uploaded;
+    mat4 V;
+    
+public:
+    ViewBlock() : ubo(0), uploaded(false) {}
+    
+    void Initialize() {
+        glGenBuffers(1, &ubo);
+        glBindBuffer(GL_UNIFORM_BUFFER, ubo);
+        glBufferData(GL_UNIFORM_BUFFER, sizeof(mat4), NULL, GL_DYNAMIC_DRAW);
+        glBindBufferBase(GL_UNIFORM_BUFFER, viewBlockBinding, ubo);
+        uploaded = false;
+    }
+    
+    void Destroy() {
+        glDeleteBuffers(1, &ubo);
+        ubo = 0;
+    }
+    
+    // returns whether the view changed
+    bool Upload(mat4 newV) {
+        if (uploaded && memcmp(&V, &newV, sizeof(mat4)) == 0) return false;
+        V = newV;
+        uploaded = true;
+        glBindBuffer(GL_UNIFORM_BUFFER, ubo);
+        glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(mat4), V.m);
+        return true;
+    }
+};
+
+ViewBlock viewBlock;
+
+// uniform location looked up once after linking; remembers the last value
+// sent so repeated uploads of the same value never reach GL
+template<typename T>
+class Uniform {
+    int location;
+    bool uploaded;
+    T value;
+    
+public:
+    Uniform() : location(-1), uploaded(false) {}
+    
+    void Resolve(unsigned int program, const char* name) {
+        location = glGetUniformLocation(program, name);
+        uploaded = false;
+    }
+    
+    bool Valid() {return location >= 0;}
+    
+    // returns false if the program has no such uniform
+    bool Set(T newValue) {
+        if (location < 0) return false;
+        if (uploaded && memcmp(&value, &newValue, sizeof(T)) == 0) return true;
+        value = newValue;
+        uploaded = true;
+        SendUniform(location, value);
+        return true;
+    }
+};
+
+// names a slot in a SlotMap; stops resolving once its occupant is removed
+struct Handle {
+    int slot;
+    unsigned int generation;
+    
+    Handle() : slot(-1), generation(0) {}
+    Handle(int slot, unsigned int generation) : slot(slot), generation(generation) {}
+    
+    bool operator==(const Handle& h) const {return slot == h.slot && generation == h.generation;}
+    bool operator!=(const Handle& h) const {return !(*this == h);}
+};
+
+// values in stable slots; freed slots are reused through a free list and
+// every reuse bumps the slot's generation, so Insert and Remove are O(1)
+// and never move other values
+template<typename T>
+class SlotMap {
+    struct Slot {
+        T value;
+        unsigned int generation;
+        int nextFree; // -2 while occupied
+    };
+    std::vector<Slot> slots;
+    int firstFree = -1;
+    int count = 0;
+    
+public:
+    Handle Insert(const T& value) {
+        int slot = firstFree;
+        if (slot >= 0) {
+            firstFree = slots[slot].nextFree;
+        }
+        else {
+            slot = (int)slots.size();
+            slots.push_back(Slot());
+            slots[slot].generation = 0;
+        }
+        slots[slot].value = value;
+        slots[slot].nextFree = -2;
+        count++;
+        return Handle(slot, slots[slot].generation);
+    }
+    
+    bool Remove(Handle h) {
+        if (!Contains(h)) return false;
+        slots[h.slot].value = T();
+        slots[h.slot].generation++;
+        slots[h.slot].nextFree = firstFree;
+        firstFree = h.slot;
+        count--;
+        return true;
+    }
+    
+    bool Contains(Handle h) const {
+        return h.slot >= 0 && h.slot < (int)slots.size() && slots[h.slot].nextFree == -2 && slots[h.slot].generation == h.generation;
+    }
+    
+    // null for stale handles
+    T* Get(Handle h) {return Contains(h) ? &slots[h.slot].value : 0;}
+    
+    int Size() const {return count;}
+    
+    // slots are visited in index order; 0..Capacity() covers every value,
+    // including those inserted while iterating
+    int Capacity() const {return (int)slots.size();}
+    bool Occupied(int slot) const {return slots[slot].nextFree == -2;}
+    T& At(int slot) {return slots[slot].value;}
+    Handle HandleAt(int slot) const {return Handle(slot, slots[slot].generation);}
+};
+
+// fixed pool of worker threads with one job deque each: a thread takes jobs
+// from the back of its own deque and, when that is empty, steals from the
+// front of someone else's. ParallelFor is the only way in; the calling thread
+// works on deque 0 until all of its chunks are done, so calls do not nest
+class JobSystem {
+    struct Job {
+        void (*run)(const void* body, int chunk, int begin, int end);
+        const void* body;
+        int chunk, begin, end;
+        std::atomic<int>* pending;
+    };
+    
+    // fixed ring of jobs, so queueing one never allocates
+    struct Deque {
+        static const int capacity = 1024;
+        std::mutex lock;
+        Job jobs[capacity];
+        int head = 0, count = 0;
+        
+        bool PushBack(const Job& job) {
+            std::lock_guard<std::mutex> guard(lock);
+            if (count == capacity) return false;
+            jobs[(head + count++) % capacity] = job;
+            return true;
+        }
+        
+        bool PopBack(Job& job) {
+            std::lock_guard<std::mutex> guard(lock);
+            if (count == 0) return false;
+            job = jobs[(head + --count) % capacity];
+            return true;
+        }
+        
+        bool PopFront(Job& job) {
+            std::lock_guard<std::mutex> guard(lock);
+            if (count == 0) return false;
+            job = jobs[head];
+            head = (head + 1) % capacity;
+            count--;
+            return true;
+        }
+    };
+    
+    std::vector<std::thread> workers;
+    Deque* deques = 0;
+    int threadCount = 1;
+    std::atomic<int> queued{0};
+    std::atomic<int> steals{0};
+    std::mutex sleepLock;
+    std::condition_variable wake;
+    bool stopping = false;
+    
+    template<typename F>
+    static void Trampoline(const void* body, int chunk, int begin, int end) {
+        (*(const F*)body)(chunk, begin, end);
+    }
+    
+    bool TakeJob(int self, Job& job) {
+        if (deques[self].PopBack(job)) {
+            queued--;
+            return true;
+        }
+        for (int i = 1; i < threadCount; i++) {
+            if (deques[(self + i) % threadCount].PopFront(job)) {
+                queued--;
+                steals++;
+                return true;
+            }
+        }
+        return false;
+    }
+    
+    static void Run(const Job& job) {
+        job.run(job.body, job.chunk, job.begin, job.end);
+        job.pending->fetch_sub(1, std::memory_order_release);
+    }
+    
+    void WorkerLoop(int self) {
+        for (;;) {
+            Job job;
+            if (TakeJob(self, job)) {
+                Run(job);
+                continue;
+            }
+            std::unique_lock<std::mutex> guard(sleepLock);
+            wake.wait(guard, [&]() {return stopping || queued.load() > 0;});
+            if (stopping) return;
+        }
+    }
+    
+public:
+    ~JobSystem() {Stop();}
+    
+    // threads counts the calling thread; 0 means one per hardware thread
+    void Start(int threads) {
+        if (threads <= 0) threads = (int)std::thread::hardware_concurrency();
+        if (threads <= 0) threads = 1;
+        threadCount = threads;
+        deques = new Deque[threadCount];
+        stopping = false;
+        for (int i = 1; i < threadCount; i++) {
+            workers.push_back(std::thread(&JobSystem::WorkerLoop, this, i));
+        }
+    }
+    
+    void Stop() {
+        {
+            std::lock_guard<std::mutex> guard(sleepLock);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (size_t i = 0; i < workers.size(); i++) workers[i].join();
+        workers.clear();
+        delete[] deques;
+        deques = 0;
+        threadCount = 1;
+    }
+    
+    int Threads() {return threadCount;}
+    int Steals() {return steals.load();}
+    
+    // calls body(chunk, begin, end) for consecutive ranges of at most grain
+    // items covering [0, count) and returns once all have run; chunk numbers
+    // are the ranges in order, so per-chunk results can be merged
+    // deterministically whatever thread ran them
+    template<typename F>
+    void ParallelFor(int count, int grain, const F& body) {
+        int chunks = (count + grain - 1) / grain;
+        if (threadCount == 1 || chunks <= 1) {
+            for (int c = 0; c < chunks; c++) body(c, c * grain, std::min(count, (c + 1) * grain));
+            return;
+        }
+        
+        // deal the chunks out round robin so every thread starts with local work
+        std::atomic<int> pending(chunks);
+        for (int c = 0; c < chunks; c++) {
+            Job job = {&Trampoline<F>, &body, c, c * grain, std::min(count, (c + 1) * grain), &pending};
+            queued++;
+            if (!deques[c % threadCount].PushBack(job)) {
+                queued--;
+                Run(job);
+            }
+        }
+        {
+            std::lock_guard<std::mutex> guard(sleepLock);
+        }
+        wake.notify_all();
+        
+        while (pending.load(std::memory_order_acquire) > 0) {
+            Job job;
+            if (TakeJob(0, job)) Run(job);
+            else std::this_thread::yield();
+        }
+    }
+};
+
+// threads for the job system, the calling thread included; 0 is one per core
+int jobThreads = 0;
+
+JobSystem jobs;
+
 class Shader
 {
 protected:
@@ -193,6 +928,7 @@ public:
         glAttachShader(shaderProgram, vertexShader);
         glAttachShader(shaderProgram, fragmentShader);
         
+        shaderCompileCount++;
     }
     
     void LinkShader()
@@ -201,32 +937,44 @@ public:
         glLinkProgram(shaderProgram);
         checkLinking(shaderProgram);
         
+        // programs that read the camera take it from the shared View block
+        unsigned int viewIndex = glGetUniformBlockIndex(shaderProgram, "View");
+        if (viewIndex != GL_INVALID_INDEX) glUniformBlockBinding(shaderProgram, viewIndex, viewBlockBinding);
     }
     
     //deconstructor
-    ~Shader() {
+    virtual ~Shader() {
         glDeleteProgram(shaderProgram);
+        renderState.ProgramDeleted(shaderProgram);
     }
     
+    unsigned int GetProgram() {return shaderProgram;}
+    
     void Run()
     {
         // make this program run
-        glUseProgram(shaderProgram);
+        renderState.UseProgram(shaderProgram);
     }
     
     virtual void UploadColor(vec4 color) {}
     virtual void UploadStripeColor(vec4 color) {}
     virtual void UploadStripeWidth(vec4 color) {}
-    virtual void UploadM(mat4 M) {}
+    virtual void UploadModel(Affine2D model) {}
     virtual void UploadSamplerID() {}
     virtual void UploadSubTextureID(int i) {}
     virtual void UploadTime(float time) {}
     virtual void UploadDimension(int dim) {}
+    virtual void UploadRegion(AtlasRegion region) {}
     
 };
 
 class TexturedShader : public Shader
 {
+    Uniform<int> samplerUnit;
+    Uniform<vec4> vertexColor;
+    Uniform<Affine2D> model;
+    Uniform<AtlasRegion> region;
+    
 public:
     TexturedShader()
     {
@@ -237,13 +985,16 @@ public:
         
         in vec2 vertexPosition;
         in vec2 vertexTexCoord;
-        uniform mat4 M;
+        layout(std140, row_major) uniform View { mat4 V; };
+        uniform vec2 model[3];  // rows of the 2D affine, then the offset
+        uniform vec4 region;    // the sprite's corner and size in the atlas
         out vec2 texCoord;
         
         void main()
         {
-            texCoord = vertexTexCoord;
-            gl_Position = vec4(vertexPosition.x, vertexPosition.y, 0, 1) * M;
+            texCoord = region.xy + vertexTexCoord * region.zw;
+            vec2 p = vertexPosition.x * model[0] + vertexPosition.y * model[1] + model[2];
+            gl_Position = vec4(p, 0, 1) * V;
         }
         )";
         
@@ -273,32 +1024,42 @@ public:
         
         LinkShader();
         
+        samplerUnit.Resolve(shaderProgram, "samplerUnit");
+        vertexColor.Resolve(shaderProgram, "vertexColor");
+        model.Resolve(shaderProgram, "model");
+        region.Resolve(shaderProgram, "region");
     }
     
     void UploadSamplerID()
     {
-        int samplerUnit = 0;
-        int location = glGetUniformLocation(shaderProgram, "samplerUnit");
-        glUniform1i(location, samplerUnit);
-        glActiveTexture(GL_TEXTURE0 + samplerUnit);
+        int unit = 0;
+        samplerUnit.Set(unit);
+        renderState.ActiveTexture(unit);
     }
     
     void UploadColor(vec4 color) {
-        int location = glGetUniformLocation(shaderProgram, "vertexColor");
-        if (location >= 0) glUniform3fv(location, 1, &color.v[0]); // set uniform variable vertexColor
-        else printf("uniform vertex color cannot be set\n");
+        if (!vertexColor.Set(color)) printf("uniform vertex color cannot be set\n");
+    }
+    
+    void UploadModel(Affine2D model) {
+        if (!this->model.Set(model)) printf("uniform model for textures cannot be set\n");
     }
     
-    void UploadM(mat4 M) {
-        int location = glGetUniformLocation(shaderProgram, "M");
-        if (location >= 0) glUniformMatrix4fv(location, 1, GL_TRUE, M);
-        else printf("uniform M for textures cannot be set\n");
+    void UploadRegion(AtlasRegion region) {
+        if (!this->region.Set(region)) printf("uniform region cannot be set\n");
     }
     
 };
 
 class AnimatedTexturedShader : public Shader
 {
+    Uniform<int> samplerUnit;
+    Uniform<vec4> vertexColor;
+    Uniform<Affine2D> model;
+    Uniform<int> subTextureID;
+    Uniform<int> dim;
+    Uniform<AtlasRegion> region;
+    
 public:
     AnimatedTexturedShader()
     {
@@ -309,13 +1070,15 @@ public:
         
         in vec2 vertexPosition;
         in vec2 vertexTexCoord;
-        uniform mat4 M;
+        layout(std140, row_major) uniform View { mat4 V; };
+        uniform vec2 model[3];  // rows of the 2D affine, then the offset
         out vec2 texCoord;
         
         void main()
         {
             texCoord = vertexTexCoord;
-            gl_Position = vec4(vertexPosition.x, vertexPosition.y, 0, 1) * M;
+            vec2 p = vertexPosition.x * model[0] + vertexPosition.y * model[1] + model[2];
+            gl_Position = vec4(p, 0, 1) * V;
         }
         )";
         
@@ -327,6 +1090,7 @@ public:
         uniform sampler2D samplerUnit;
         uniform int subTextureID;
         uniform int dim;
+        uniform vec4 region;    // the whole sheet's corner and size in the atlas
         in vec2 texCoord;
         out vec4 fragmentColor;
         
@@ -334,7 +1098,7 @@ public:
         {
             int i = subTextureID % dim;
             int j = subTextureID / dim;
-            fragmentColor = texture(samplerUnit, (vec2(i, j) + texCoord) / dim);
+            fragmentColor = texture(samplerUnit, region.xy + (vec2(i, j) + texCoord) / dim * region.zw);
         }
         )";
         
@@ -349,108 +1113,398 @@ public:
         
         LinkShader();
         
+        samplerUnit.Resolve(shaderProgram, "samplerUnit");
+        vertexColor.Resolve(shaderProgram, "vertexColor");
+        model.Resolve(shaderProgram, "model");
+        subTextureID.Resolve(shaderProgram, "subTextureID");
+        dim.Resolve(shaderProgram, "dim");
+        region.Resolve(shaderProgram, "region");
     }
     
     void UploadSamplerID()
     {
-        int samplerUnit = 0;
-        int location = glGetUniformLocation(shaderProgram, "samplerUnit");
-        glUniform1i(location, samplerUnit);
-        glActiveTexture(GL_TEXTURE0 + samplerUnit);
+        int unit = 0;
+        samplerUnit.Set(unit);
+        renderState.ActiveTexture(unit);
     }
     
     void UploadColor(vec4 color) {
-        int location = glGetUniformLocation(shaderProgram, "vertexColor");
-        if (location >= 0) glUniform3fv(location, 1, &color.v[0]); // set uniform variable vertexColor
-        else printf("uniform vertex color cannot be set\n");
+        if (!vertexColor.Set(color)) printf("uniform vertex color cannot be set\n");
     }
     
-    void UploadM(mat4 M) {
-        int location = glGetUniformLocation(shaderProgram, "M");
-        if (location >= 0) glUniformMatrix4fv(location, 1, GL_TRUE, M);
-        else printf("uniform M for textures cannot be set\n");
+    void UploadModel(Affine2D model) {
+        if (!this->model.Set(model)) printf("uniform model for textures cannot be set\n");
     }
     
-    void UploadSubTextureID(int i) {
-        int location = glGetUniformLocation(shaderProgram, "subTextureID");
-        if (location >= 0) glUniform1i(location, i);
-        else printf("sub texture id cannot be set\n");
+    void UploadRegion(AtlasRegion region) {
+        if (!this->region.Set(region)) printf("uniform region cannot be set\n");
     }
     
-    void UploadTime(float time) {
-        int i = (int)floor(time * 10) % 36;
-        UploadSubTextureID(i);
+    void UploadSubTextureID(int i) {
+        if (!subTextureID.Set(i)) printf("sub texture id cannot be set\n");
     }
     
     void UploadDimension(int dim) {
-        int location = glGetUniformLocation(shaderProgram, "dim");
-        if (location >= 0) glUniform1i(location, dim);
-        else printf("dimension cannot be set\n");
+        if (!this->dim.Set(dim)) printf("dimension cannot be set\n");
     }
     
 };
 
-
-extern "C" unsigned char* stbi_load(char const *filename, int *x, int *y, int *comp, int req_comp);
-
-class Texture {
-    unsigned int textureId;
+// same look as TexturedShader, but the model affine and atlas region come
+// from per-instance attributes so a whole batch is one draw call
+class InstancedTexturedShader : public Shader
+{
+    Uniform<int> samplerUnit;
+    
 public:
-    Texture(const std::string& inputFileName){
-        unsigned char* data;
-        int width; int height; int nComponents = 4;
+    InstancedTexturedShader()
+    {
         
-        data = stbi_load(inputFileName.c_str(), &width, &height, &nComponents, 0);
+        const char *vertexSource = R"(
+#version 410
+        precision highp float;
         
-        if(data == NULL) {
-            printf("NULL :(");
-            return;
-            
+        in vec2 vertexPosition;
+        in vec2 vertexTexCoord;
+        in vec4 instanceLinear;     // rows of the 2D affine
+        in vec2 instanceOffset;
+        in vec4 instanceRegion;     // corner and size in the atlas
+        layout(std140, row_major) uniform View { mat4 V; };
+        out vec2 texCoord;
+        
+        void main()
+        {
+            texCoord = instanceRegion.xy + vertexTexCoord * instanceRegion.zw;
+            vec2 p = vertexPosition.x * instanceLinear.xy + vertexPosition.y * instanceLinear.zw + instanceOffset;
+            gl_Position = vec4(p, 0, 1) * V;
         }
+        )";
         
-        glGenTextures(1, &textureId);
-        glBindTexture(GL_TEXTURE_2D, textureId);
+        // fragment shader in GLSL
+        const char *fragmentSource = R"(
+#version 410
+        precision highp float;
         
-        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, data);
+        uniform sampler2D samplerUnit;
+        in vec2 texCoord;
+        out vec4 fragmentColor;
         
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        void main()
+        {
+            fragmentColor = texture(samplerUnit, texCoord);
+        }
+        )";
+        
+        CompileShader(vertexSource, fragmentSource);
+        
+        glBindAttribLocation(shaderProgram, 0, "vertexPosition");
+        glBindAttribLocation(shaderProgram, 1, "vertexTexCoord");
+        glBindAttribLocation(shaderProgram, 2, "instanceLinear");
+        glBindAttribLocation(shaderProgram, 3, "instanceOffset");
+        glBindAttribLocation(shaderProgram, 4, "instanceRegion");
+        
+        glBindFragDataLocation(shaderProgram, 0, "fragmentColor");
+        
+        LinkShader();
         
-        delete data;
+        samplerUnit.Resolve(shaderProgram, "samplerUnit");
     }
     
-    void Bind()
+    void UploadSamplerID()
     {
-        glBindTexture(GL_TEXTURE_2D, textureId);
+        int unit = 0;
+        samplerUnit.Set(unit);
+        renderState.ActiveTexture(unit);
     }
+    
 };
 
-
+// copies a screen-sized texture onto the screen, one texel per pixel
+class CompositeShader : public Shader
+{
+    Uniform<int> samplerUnit;
+    
+public:
+    CompositeShader()
+    {
+        
+        const char *vertexSource = R"(
+#version 410
+        precision highp float;
+        
+        in vec2 vertexPosition;
+        in vec2 vertexTexCoord;
+        out vec2 texCoord;
+        
+        void main()
+        {
+            texCoord = vertexTexCoord;
+            gl_Position = vec4(vertexPosition * 2, 0, 1); // the unit quad covers the screen
+        }
+        )";
+        
+        // fragment shader in GLSL
+        const char *fragmentSource = R"(
+#version 410
+        precision highp float;
+        
+        uniform sampler2D samplerUnit;
+        in vec2 texCoord;
+        out vec4 fragmentColor;
+        
+        void main()
+        {
+            fragmentColor = texture(samplerUnit, texCoord);
+        }
+        )";
+        
+        CompileShader(vertexSource, fragmentSource);
+        
+        glBindAttribLocation(shaderProgram, 0, "vertexPosition");
+        glBindAttribLocation(shaderProgram, 1, "vertexTexCoord");
+        
+        glBindFragDataLocation(shaderProgram, 0, "fragmentColor");
+        
+        LinkShader();
+        
+        samplerUnit.Resolve(shaderProgram, "samplerUnit");
+    }
+    
+    void UploadSamplerID()
+    {
+        int unit = 0;
+        samplerUnit.Set(unit);
+        renderState.ActiveTexture(unit);
+    }
+    
+};
+
+// compiles each shader variant once at startup and hands out the shared programs
+class ShaderRegistry {
+    TexturedShader* textured;
+    AnimatedTexturedShader* animated;
+    InstancedTexturedShader* instanced;
+    CompositeShader* composite;
+    int compilesAtFrameStart;
+    int compilesLastFrame;
+    
+public:
+    ShaderRegistry() {
+        textured = 0;
+        animated = 0;
+        instanced = 0;
+        composite = 0;
+        compilesAtFrameStart = 0;
+        compilesLastFrame = 0;
+    }
+    
+    void Initialize() {
+        textured = new TexturedShader();
+        animated = new AnimatedTexturedShader();
+        instanced = new InstancedTexturedShader();
+        composite = new CompositeShader();
+        compilesAtFrameStart = shaderCompileCount;
+    }
+    
+    void Destroy() {
+        delete textured;
+        delete animated;
+        delete instanced;
+        delete composite;
+        textured = 0;
+        animated = 0;
+        instanced = 0;
+        composite = 0;
+    }
+    
+    TexturedShader* Textured() {return textured;}
+    AnimatedTexturedShader* Animated() {return animated;}
+    InstancedTexturedShader* Instanced() {return instanced;}
+    CompositeShader* Composite() {return composite;}
+    
+    // call once per frame; compiles after Initialize should stay at zero
+    void EndFrame() {
+        compilesLastFrame = shaderCompileCount - compilesAtFrameStart;
+        compilesAtFrameStart = shaderCompileCount;
+    }
+    
+    int CompilesLastFrame() {return compilesLastFrame;}
+};
+
+ShaderRegistry shaderRegistry;
+
+
+extern "C" unsigned char* stbi_load(char const *filename, int *x, int *y, int *comp, int req_comp);
+extern "C" int stbi_info(char const *filename, int *x, int *y, int *comp);
+extern "C" void stbi_image_free(void *retval_from_stbi_load);
+
+class Texture {
+    unsigned int textureId = 0;
+public:
+    // RGBA, width * height * 4 bytes
+    Texture(int width, int height, const unsigned char* pixels){
+        // the null renderer never samples pixels
+#if !defined(GALAXY_HEADLESS)
+        glGenTextures(1, &textureId);
+        renderState.BindTexture(textureId);
+        
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, pixels);
+        
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+#endif
+    }
+    
+    ~Texture() {
+        if (textureId) {
+            glDeleteTextures(1, &textureId);
+            renderState.TextureDeleted(textureId);
+        }
+    }
+    
+    unsigned int GetId() {return textureId;}
+    
+    void Bind()
+    {
+        renderState.BindTexture(textureId);
+    }
+};
+
+// directory the sprite images are loaded from
+const std::string assetPath = "/Users/Tongyu/Documents/AIT_Budapest/Graphics/Galaxy/Galaxy/";
+
+// every sprite image packed into one texture at startup, so drawing a
+// different sprite never means binding a different texture
+class TextureAtlas {
+    static const int atlasWidth = 2048;
+    static const int padding = 2; // keeps linear filtering from bleeding between images
+    
+    Texture* texture;
+    std::map<std::string, AtlasRegion> regions;
+    int width, height;
+    
+public:
+    TextureAtlas() : texture(0), width(0), height(0) {}
+    
+    // loads the images from directory and packs them onto shelves, tallest
+    // first; headless builds only read the image sizes
+    void Build(const std::string& directory, const char* const* names, int count) {
+        std::vector<int> w(count, 0), h(count, 0), x(count, 0), y(count, 0);
+        std::vector<unsigned char*> pixels(count, (unsigned char*)0);
+        std::vector<int> order;
+        for (int i = 0; i < count; i++) {
+            std::string path = directory + names[i];
+            int components;
+#if defined(GALAXY_HEADLESS)
+            bool loaded = stbi_info(path.c_str(), &w[i], &h[i], &components) != 0;
+#else
+            pixels[i] = stbi_load(path.c_str(), &w[i], &h[i], &components, 4); // paletted or RGB images come back as RGBA too
+            bool loaded = pixels[i] != NULL;
+#endif
+            if (!loaded) {
+#if !defined(GALAXY_HEADLESS)
+                printf("cannot load %s\n", path.c_str());
+#endif
+                w[i] = h[i] = 0;
+                continue;
+            }
+            order.push_back(i);
+        }
+        std::sort(order.begin(), order.end(), [&](int a, int b) {return h[a] > h[b];});
+        
+        int shelfX = padding, shelfY = padding, shelfHeight = 0;
+        for (size_t k = 0; k < order.size(); k++) {
+            int i = order[k];
+            if (shelfX + w[i] + padding > atlasWidth) {
+                shelfY += shelfHeight + padding;
+                shelfX = padding;
+                shelfHeight = 0;
+            }
+            x[i] = shelfX;
+            y[i] = shelfY;
+            shelfX += w[i] + padding;
+            shelfHeight = std::max(shelfHeight, h[i]);
+        }
+        width = atlasWidth;
+        height = 1;
+        while (height < shelfY + shelfHeight + padding) height *= 2;
+        
+        std::vector<unsigned char> atlas;
+#if !defined(GALAXY_HEADLESS)
+        atlas.assign((size_t)width * height * 4, 0);
+#endif
+        for (int i = 0; i < count; i++) {
+            AtlasRegion region = {(float)x[i] / width, (float)y[i] / height, (float)w[i] / width, (float)h[i] / height};
+            regions[names[i]] = region;
+            if (!pixels[i]) continue;
+            for (int row = 0; row < h[i]; row++) {
+                memcpy(&atlas[((size_t)(y[i] + row) * width + x[i]) * 4], pixels[i] + (size_t)row * w[i] * 4, w[i] * 4);
+            }
+            stbi_image_free(pixels[i]);
+        }
+        texture = new Texture(width, height, atlas.empty() ? 0 : &atlas[0]);
+    }
+    
+    void Destroy() {
+        delete texture;
+        texture = 0;
+        regions.clear();
+    }
+    
+    Texture* GetTexture() {return texture;}
+    int Width() {return width;}
+    int Height() {return height;}
+    
+    // where a packed image lies; empty for images that were not packed
+    AtlasRegion Region(const std::string& name) {
+        std::map<std::string, AtlasRegion>::iterator it = regions.find(name);
+        if (it == regions.end()) {
+            printf("%s is not in the atlas\n", name.c_str());
+            AtlasRegion empty = {0, 0, 0, 0};
+            return empty;
+        }
+        return it->second;
+    }
+};
+
+TextureAtlas spriteAtlas;
+
 class Material {
     
     Shader* shader;
     
 public:
     Material(Shader* shader) : shader(shader) {}
+    virtual ~Material() {}
     
     virtual void UploadAttributes() {}
+    virtual Texture* GetTexture() {return 0;}
+    virtual void SetTime(float time) {}
+    
+    // the part of the texture this material shows right now
+    virtual AtlasRegion GetRegion() {return AtlasRegion();}
 };
 
 class TextureMaterial : public Material {
     
     TexturedShader* shader;
     Texture* texture;
+    AtlasRegion region;
     vec4 color;
     
 public:
-    TextureMaterial(TexturedShader* shader, vec4 color, Texture* texture) :
-    Material(shader), shader(shader), color(color), texture(texture){}
+    TextureMaterial(TexturedShader* shader, vec4 color, Texture* texture, AtlasRegion region) :
+    Material(shader), shader(shader), color(color), texture(texture), region(region){}
+    
+    Texture* GetTexture() {return texture;}
+    AtlasRegion GetRegion() {return region;}
     
     void UploadAttributes() {
         if(texture)
         {
             shader->UploadSamplerID();
             texture->Bind();
+            shader->UploadRegion(region);
         }
         else
         shader->UploadColor(color);
@@ -462,19 +1516,40 @@ class AnimatedTexturedMaterial : public Material {
     
     AnimatedTexturedShader* shader;
     Texture* texture;
+    AtlasRegion region;
     vec4 color;
     int dim;
+    int frame;
     
 public:
-    AnimatedTexturedMaterial(AnimatedTexturedShader* shader, vec4 color, Texture* texture, int dim) :
-    Material(shader), shader(shader), color(color), texture(texture), dim(dim){}
+    AnimatedTexturedMaterial(AnimatedTexturedShader* shader, vec4 color, Texture* texture, AtlasRegion region, int dim) :
+    Material(shader), shader(shader), color(color), texture(texture), region(region), dim(dim), frame(0){}
+    
+    Texture* GetTexture() {return texture;}
+    
+    // ten frames a second; the frame stays on the sheet so it never reads a
+    // neighbouring atlas image
+    void SetTime(float time) {
+        frame = (int)floor(time * 10) % 36 % (dim * dim);
+    }
+    
+    AtlasRegion GetRegion() {
+        AtlasRegion r;
+        r.width = region.width / dim;
+        r.height = region.height / dim;
+        r.u = region.u + (frame % dim) * r.width;
+        r.v = region.v + (frame / dim) * r.height;
+        return r;
+    }
     
     void UploadAttributes() {
         if(texture)
         {
             shader->UploadSamplerID();
             texture->Bind();
+            shader->UploadRegion(region);
             shader->UploadDimension(dim);
+            shader->UploadSubTextureID(frame);
         }
         else
         shader->UploadColor(color);
@@ -482,6 +1557,9 @@ public:
     }
 };
 
+// total vertex array objects created so far; see GeometryRegistry::EndFrame
+int vertexArrayCount = 0;
+
 class Geometry{
     
 protected: unsigned int vao;    // vertex array object id
@@ -489,6 +1567,11 @@ protected: unsigned int vao;    // vertex array object id
 public:
     Geometry(){
         glGenVertexArrays(1, &vao);    // create a vertex array object
+        vertexArrayCount++;
+    }
+    virtual ~Geometry() {
+        glDeleteVertexArrays(1, &vao);
+        renderState.VertexArrayDeleted(vao);
     }
     
     virtual void Draw() = 0;
@@ -501,7 +1584,7 @@ class Triangle : public Geometry
 public:
     Triangle()
     {
-        glBindVertexArray(vao);        // make it active
+        renderState.BindVertexArray(vao);        // make it active
         
         glGenBuffers(1, &vbo);        // generate a vertex buffer object
         
@@ -524,9 +1607,15 @@ public:
                               0, NULL);        // stride and offset: it is tightly packed
     }
     
+    ~Triangle()
+    {
+        glDeleteBuffers(1, &vbo);
+    }
+    
     void Draw()
     {
-        glBindVertexArray(vao);    // make the vao and its vbos active playing the role of the data source
+        renderState.Blend(false);
+        renderState.BindVertexArray(vao);    // make the vao and its vbos active playing the role of the data source
         glDrawArrays(GL_TRIANGLES, 0, 3); // draw a single triangle with vertices defined in vao
     }
 };
@@ -538,7 +1627,7 @@ class Quad : public Geometry
 public:
     Quad()
     {
-        glBindVertexArray(vao);
+        renderState.BindVertexArray(vao);
         
         glGenBuffers(1, &vbo);
         
@@ -549,9 +1638,15 @@ public:
         glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 0, NULL);
     }
     
+    ~Quad()
+    {
+        glDeleteBuffers(1, &vbo);
+    }
+    
     void Draw()
     {
-        glBindVertexArray(vao);
+        renderState.Blend(false);
+        renderState.BindVertexArray(vao);
         glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
     }
 };
@@ -563,7 +1658,7 @@ class TexturedQuad : public Quad
 public:
     TexturedQuad()
     {
-        glBindVertexArray(vao);
+        renderState.BindVertexArray(vao);
         glGenBuffers(1, &vboTex);
         
         glBindBuffer(GL_ARRAY_BUFFER, vboTex);
@@ -577,16 +1672,124 @@ public:
         // vertex attribute array 1
     }
     
+    ~TexturedQuad()
+    {
+        glDeleteBuffers(1, &vboTex);
+    }
+    
     void Draw()
     {
-        glEnable(GL_BLEND); // necessary for transparent pixels
-        glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
-        glBindVertexArray(vao);
+        // every sprite blends, so blending stays on until something opaque draws
+        renderState.SpriteBlend(); // necessary for transparent pixels
+        renderState.BindVertexArray(vao);
+        glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+    }
+    
+    // for textures whose colors are already multiplied by their alpha
+    void DrawPremultiplied()
+    {
+        renderState.Blend(true);
+        renderState.BlendFunc(GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
+        renderState.BindVertexArray(vao);
         glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
-        glDisable(GL_BLEND);
     }
 };
 
+// TexturedQuad plus a per-instance attribute buffer, drawn with one instanced call
+class InstancedTexturedQuad : public TexturedQuad
+{
+    unsigned int vboInstance;
+    int capacity;
+    
+public:
+    // floats per instance: the affine's two rows and offset, then the atlas region
+    static const int instanceFloats = 10;
+    
+    InstancedTexturedQuad()
+    {
+        capacity = 0;
+        renderState.BindVertexArray(vao);
+        glGenBuffers(1, &vboInstance);
+        
+        glBindBuffer(GL_ARRAY_BUFFER, vboInstance);
+        glEnableVertexAttribArray(2);
+        glVertexAttribPointer(2, 4, GL_FLOAT, GL_FALSE, instanceFloats * sizeof(float), NULL);
+        glVertexAttribDivisor(2, 1); // advance once per instance, not per vertex
+        glEnableVertexAttribArray(3);
+        glVertexAttribPointer(3, 2, GL_FLOAT, GL_FALSE, instanceFloats * sizeof(float), (void*)(4 * sizeof(float)));
+        glVertexAttribDivisor(3, 1);
+        glEnableVertexAttribArray(4);
+        glVertexAttribPointer(4, 4, GL_FLOAT, GL_FALSE, instanceFloats * sizeof(float), (void*)(6 * sizeof(float)));
+        glVertexAttribDivisor(4, 1);
+    }
+    
+    ~InstancedTexturedQuad()
+    {
+        glDeleteBuffers(1, &vboInstance);
+    }
+    
+    // the buffer is orphaned before every upload: the driver hands back fresh
+    // storage while earlier draws still read the old one, so we never stall
+    void UploadInstances(const float* instanceData, int count)
+    {
+        if (count <= 0) return;
+        glBindBuffer(GL_ARRAY_BUFFER, vboInstance);
+        if (count > capacity) capacity = count;
+        glBufferData(GL_ARRAY_BUFFER, capacity * instanceFloats * sizeof(float), NULL, GL_STREAM_DRAW);
+        glBufferSubData(GL_ARRAY_BUFFER, 0, count * instanceFloats * sizeof(float), instanceData);
+    }
+    
+    void DrawInstanced(int count)
+    {
+        renderState.SpriteBlend(); // necessary for transparent pixels
+        renderState.BindVertexArray(vao);
+        glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 4, count);
+    }
+};
+
+// the geometry every sprite shares: one unit quad for the per-object draws
+// and one instanced quad, both made before the scene is built
+class GeometryRegistry {
+    TexturedQuad* sprite;
+    InstancedTexturedQuad* instancedSprite;
+    int arraysAtFrameStart;
+    int arraysLastFrame;
+    
+public:
+    GeometryRegistry() {
+        sprite = 0;
+        instancedSprite = 0;
+        arraysAtFrameStart = 0;
+        arraysLastFrame = 0;
+    }
+    
+    void Initialize() {
+        sprite = new TexturedQuad();
+        instancedSprite = new InstancedTexturedQuad();
+        arraysAtFrameStart = vertexArrayCount;
+    }
+    
+    void Destroy() {
+        delete sprite;
+        delete instancedSprite;
+        sprite = 0;
+        instancedSprite = 0;
+    }
+    
+    TexturedQuad* Sprite() {return sprite;}
+    InstancedTexturedQuad* InstancedSprite() {return instancedSprite;}
+    
+    // call once per frame; vertex arrays made after Initialize should stay at zero
+    void EndFrame() {
+        arraysLastFrame = vertexArrayCount - arraysAtFrameStart;
+        arraysAtFrameStart = vertexArrayCount;
+    }
+    
+    int VertexArraysLastFrame() {return arraysLastFrame;}
+};
+
+GeometryRegistry geometryRegistry;
+
 class Mesh{
     
     Geometry *geometry;
@@ -596,6 +1799,8 @@ public:
     Mesh(Geometry *geometry,
          Material *material) : geometry(geometry), material(material) {}
     
+    Material* GetMaterial() {return material;}
+    
     void Draw() {
         material->UploadAttributes();
         geometry->Draw();
@@ -605,6 +1810,45 @@ public:
 bool keyboardState[256] = {false};
 bool blackHolePlaced = false;
 vec2 blackHolePos = vec2(0, 0.4);
+int blackHoleCount = 1;  // holes the b key places
+float gravityTheta = 0.5; // Barnes-Hut opening angle, 0 for the exact sum
+int gravityFieldCells = 0; // cells per side of the cached gravity field, 0 for none
+
+// how far the current frame is between the last two simulation ticks, 0..1
+float renderAlpha = 1;
+
+// accumulates frame time and hands it out as whole simulation ticks
+class FixedTimestep {
+    double step;
+    int maxSteps;
+    double accumulator;
+    
+public:
+    FixedTimestep(double tickRate, int maxSteps) : step(1.0 / tickRate), maxSteps(maxSteps), accumulator(0) {}
+    
+    void SetTickRate(double tickRate) {step = 1.0 / tickRate;}
+    double Step() {return step;}
+    
+    // number of ticks to run for this frame; after a hitch at most maxSteps
+    // ticks are run and the rest of the backlog is dropped
+    int Advance(double frameDt) {
+        accumulator += frameDt;
+        int steps = (int)(accumulator / step);
+        if (steps > maxSteps) {
+            steps = maxSteps;
+            accumulator = 0;
+        }
+        else {
+            accumulator -= steps * step;
+        }
+        return steps;
+    }
+    
+    float Alpha() {return (float)(accumulator / step);}
+};
+
+FixedTimestep timestep(60, 5);
+double simulationTime = 0;
 
 class Camera {
     
@@ -628,6 +1872,12 @@ public:
         return M;
     }
     
+    // whether a circle around p overlaps the view
+    bool IsVisible(vec2 p, float radius) {
+        return fabsf(p.x - center.x * horizontal_size) <= horizontal_size + radius &&
+               fabsf(p.y - center.y * vertical_size) <= vertical_size + radius;
+    }
+    
     void Move(double dt, double t) {
         
         // Quake
@@ -657,96 +1907,789 @@ public:
 
 Camera camera(vec2(0,0),1.5,1.5);
 
-class Object{
-    Shader *shader;
-    Mesh *mesh;
-    vec2 position, scaling;
-    float orientation;
+// distance at which a projectile hits an enemy or asteroid
+const float projectileHitRadius = 0.2;
+
+class Object;
+class EntityQuery;
+
+enum EntityType {
+    ENTITY_AVATAR,
+    ENTITY_PROJECTILE,
+    ENTITY_FIREBALL,
+    ENTITY_ASTEROID,
+    ENTITY_HEART,
+    ENTITY_EGG,
+    ENTITY_SEEKER,
+    ENTITY_EXPLOSION,
+    ENTITY_BLACKHOLE,
+};
+
+enum EntityFlags {
+    ENTITY_TARGET = 1,   // can be hit by projectiles
+    ENTITY_HIT = 2,      // hit by a projectile this tick
+    ENTITY_DRAMATIC = 4, // spinning out after a quake
+    ENTITY_MOVED = 8,    // cached transform is stale; see UpdateTransforms
+};
+
+// sprites waiting for their transform, one array per field so the affine
+// kernel can read them with vector loads
+struct SpriteArrays {
+    std::vector<float> x, y, scalingX, scalingY, orientation;
     
-public:
-    Object(Shader *shader, Mesh *mesh, vec2 position, vec2 scaling, float orientation) :
-    shader(shader), mesh(mesh), position(position), scaling(scaling), orientation(orientation) {}
+    int Size() const {return (int)x.size();}
     
-    virtual void UploadAttributes() {}
+    void Reserve(int n) {
+        x.reserve(n); y.reserve(n);
+        scalingX.reserve(n); scalingY.reserve(n);
+        orientation.reserve(n);
+    }
     
-    void Draw() {
-        UploadAttributes();
-        mesh->Draw();
+    void Clear() {
+        x.clear(); y.clear();
+        scalingX.clear(); scalingY.clear();
+        orientation.clear();
     }
     
-    virtual void SetTime(float time) {}
-    virtual void Move(float dt, float time_lapsed) {}
-    virtual Shader* GetShader() {return shader;}
-    virtual vec2 GetLocation() {return position;}
-    virtual bool ShouldBeDeleted() {return false;}
-    virtual void Control(std::vector<Object*> objects, int me,
-                         std::vector<std::vector<Object*>> asteroid_objects) {}
-    virtual void HitByProjectile(Object* projectile) {}
-    virtual void TargetHit() {}
-    virtual bool IsEnemy() {return false;}
-    virtual bool DoneExploding(float time) {return false;}
-    virtual void SetDramatic() {}
-    virtual void DramaticExit() {}
-    virtual bool IsBlackHole() {return false;}
+    void Add(vec2 position, vec2 scaling, float orientation) {
+        x.push_back(position.x);
+        y.push_back(position.y);
+        scalingX.push_back(scaling.x);
+        scalingY.push_back(scaling.y);
+        this->orientation.push_back(orientation);
+    }
 };
 
-class AvatarObject : public Object{
-    Shader *shader;
-    Mesh *mesh;
-    vec2 position, scaling;
-    float orientation;
-    float velocity = 0.3;
-    float acceleration;
-    float invMass = 0.3;
-    float lastTime = 0;
-    float force = 1;
-    bool aPressed, dPressed, wPressed, sPressed;
-    
-public:
-    AvatarObject(Shader *shader, Mesh *mesh, vec2 position, vec2 scaling, float orientation) :
-    Object(shader, mesh, position, scaling, orientation), shader(shader), mesh(mesh), position(position), scaling(scaling), orientation(orientation) {
-        aPressed = false;
-        dPressed = false;
-        wPressed = false;
-        sPressed = false;
+// mass of one black hole; an asteroid weighs 0.5
+const float blackHoleMass = 40;
+
+// pull of the black holes on the asteroids. The holes sit in a quadtree whose
+// nodes carry their total mass and centre of mass (Barnes-Hut): a node that
+// looks smaller than theta from a body pulls as one hole, so a body costs
+// about log(holes) pulls instead of one per hole. theta 0 sums every hole
+// directly, the exact reference
+class GravitySolver {
+    struct Node {
+        float x, y;       // centre of mass
+        float mass;       // 0 for an empty quadrant
+        float size;       // side of the node's square
+        int child;        // first of the four children, -1 for a leaf
+        int first, count; // holes of a leaf, indices into order
+    };
+    
+    static const int leafHoles = 4; // a leaf this small is cheaper to sum than to split
+    static const int maxDepth = 16; // holes closer than this resolves share a leaf
+    
+    std::vector<float> holeX, holeY, holeMass;
+    std::vector<int> order;                    // hole indices, grouped by leaf
+    std::vector<float> leafX, leafY, leafMass; // the holes in that order
+    std::vector<Node> nodes;
+    float theta;
+    
+    // the law of gravitation the single black hole always used, as the
+    // acceleration it gives a body dx, dy away from it
+    static void Pull(float m1, float dx, float dy, float& ax, float& ay) {
+        float length = sqrtf(dx*dx + dy*dy);
+        if (length == 0) return;
+        float m2 = 0.5; //asteroid mass
+        float r = length*100;
+        float force = 9.81*((m1*m2)/r*r); //law of gravitation
+        float acceleration = force*(1/m2);
+        ax += dx/length*acceleration;
+        ay += dy/length*acceleration;
     }
     
-    void UploadAttributes() {
-        mat4 S = {scaling.x,0,0,0,
-            0,scaling.y,0,0,
-            0,0,1,0,
-            0,0,0,1};
+    // fills in node index from the holes order[first .. first + count), which
+    // it reorders so every child's holes are contiguous
+    void Subdivide(int index, float minX, float minY, float size, int first, int count, int depth) {
+        Node node = {0, 0, 0, size, -1, first, count};
+        for (int i = first; i < first + count; i++) {
+            int h = order[i];
+            node.mass += holeMass[h];
+            node.x += holeX[h] * holeMass[h];
+            node.y += holeY[h] * holeMass[h];
+        }
+        if (node.mass > 0) {
+            node.x /= node.mass;
+            node.y /= node.mass;
+        }
+        if (count <= leafHoles || depth == maxDepth) {
+            nodes[index] = node;
+            return;
+        }
         
-        float radians = orientation/180*M_PI;
-        mat4 R = {cos(radians),sin(radians),0,0,
-            -sin(radians),cos(radians),0,0,
-            0,0,1,0,
-            0,0,0,1};
+        float half = size / 2;
+        float midX = minX + half, midY = minY + half;
+        int* begin = &order[first];
+        int* end = begin + count;
+        int* top = std::partition(begin, end, [&](int h) {return holeY[h] < midY;});
+        int* bottomRight = std::partition(begin, top, [&](int h) {return holeX[h] < midX;});
+        int* topRight = std::partition(top, end, [&](int h) {return holeX[h] < midX;});
         
-        mat4 T = {1,0,0,0,
-            0,1,0,0,
-            0,0,1,0,
-            position.x,position.y,0,1};
+        node.child = (int)nodes.size();
+        nodes[index] = node;
+        nodes.resize(nodes.size() + 4);
+        int bounds[5] = {first, first + (int)(bottomRight - begin), first + (int)(top - begin), first + (int)(topRight - begin), first + count};
+        for (int q = 0; q < 4; q++) {
+            Subdivide(node.child + q, q & 1 ? midX : minX, q & 2 ? midY : minY, half, bounds[q], bounds[q + 1] - bounds[q], depth + 1);
+        }
+    }
+    
+public:
+    GravitySolver(float theta = 0.5) : theta(theta) {}
+    
+    void SetTheta(float t) {theta = t;}
+    float Theta() const {return theta;}
+    int Holes() const {return (int)holeX.size();}
+    int Nodes() const {return (int)nodes.size();}
+    
+    void Clear() {
+        holeX.clear();
+        holeY.clear();
+        holeMass.clear();
+        nodes.clear();
+    }
+    
+    // call Build once the holes have been added
+    void AddHole(vec2 position, float mass = blackHoleMass) {
+        holeX.push_back(position.x);
+        holeY.push_back(position.y);
+        holeMass.push_back(mass);
+    }
+    
+    void Build() {
+        nodes.clear();
+        int n = Holes();
+        if (n == 0) return;
+        order.resize(n);
+        float minX = holeX[0], minY = holeY[0], maxX = holeX[0], maxY = holeY[0];
+        for (int h = 0; h < n; h++) {
+            order[h] = h;
+            minX = std::min(minX, holeX[h]);
+            minY = std::min(minY, holeY[h]);
+            maxX = std::max(maxX, holeX[h]);
+            maxY = std::max(maxY, holeY[h]);
+        }
+        // a little slack so the holes on the far edges stay inside
+        float size = std::max(maxX - minX, maxY - minY) * 1.001f + 1e-6f;
+        nodes.resize(1);
+        Subdivide(0, minX, minY, size, 0, n, 0);
         
-        mat4 V = camera.GetViewTransformationMatrix();
-        mat4 M = S * R * T * V; // scaling, rotation, and translation
-        shader->UploadM(M);
+        leafX.resize(n);
+        leafY.resize(n);
+        leafMass.resize(n);
+        for (int i = 0; i < n; i++) {
+            leafX[i] = holeX[order[i]];
+            leafY[i] = holeY[order[i]];
+            leafMass[i] = holeMass[order[i]];
+        }
     }
     
-    void SetTime(float time) {
-        shader->Run();
-        shader->UploadTime(time);
+    // the pull of every hole summed without the tree, whatever theta is
+    void ExactAcceleration(float x, float y, float& ax, float& ay) const {
+        ax = 0;
+        ay = 0;
+        for (int h = 0; h < Holes(); h++) Pull(holeMass[h], holeX[h] - x, holeY[h] - y, ax, ay);
     }
     
-    void Move(float dt, float time_lapsed) {
-        if (keyboardState['a'] || keyboardState['d'] || keyboardState['w'] || keyboardState['s']) {
-            force = force + 2*dt;
-            acceleration = force*invMass;
-            velocity = velocity + acceleration * dt; //new velocity
-            if (keyboardState['a']) {
-                position.x = position.x - (velocity * dt);
-                aPressed = true;
-            }
+    // summed acceleration of the holes on a body at x, y
+    void Acceleration(float x, float y, float& ax, float& ay) const {
+        if (theta <= 0) {
+            ExactAcceleration(x, y, ax, ay);
+            return;
+        }
+        ax = 0;
+        ay = 0;
+        if (nodes.empty()) return;
+        
+        float theta2 = theta * theta;
+        int stack[3 * maxDepth + 2];
+        int top = 0;
+        stack[top++] = 0;
+        while (top > 0) {
+            const Node& node = nodes[stack[--top]];
+            if (node.mass == 0) continue;
+            float dx = node.x - x, dy = node.y - y;
+            if (node.count == 1 || node.size * node.size < theta2 * (dx*dx + dy*dy)) Pull(node.mass, dx, dy, ax, ay);
+            else if (node.child < 0) {
+                for (int i = node.first; i < node.first + node.count; i++) Pull(leafMass[i], leafX[i] - x, leafY[i] - y, ax, ay);
+            }
+            else {
+                for (int q = 0; q < 4; q++) stack[top++] = node.child + q;
+            }
+        }
+    }
+};
+
+// the exact pull of the holes sampled once on a grid of nodes over the play
+// area, so a body costs one bilinear lookup instead of its pulls; only worth
+// building while the holes stay put. Bodies outside the area ask the solver
+class GravityField {
+    const GravitySolver* solver;
+    float minX, minY, cellWidth, cellHeight;
+    int cells; // per side, as last built
+    bool valid;
+    std::vector<float> field; // ax, ay of every node, row by row
+    int builds;
+    double buildSeconds;
+    float meanError, maxError;
+    
+    // how far the field strays from the exact pull at cell centres, where
+    // it is least accurate, relative to the mean exact pull
+    void MeasureError() {
+        int stride = cells > 128 ? cells / 128 : 1;
+        double sum = 0, magnitude = 0, largest = 0;
+        int samples = 0;
+        for (int j = 0; j < cells; j += stride) {
+            for (int i = 0; i < cells; i += stride) {
+                float x = minX + (i + 0.5f) * cellWidth, y = minY + (j + 0.5f) * cellHeight;
+                float ax, ay, ex, ey;
+                Acceleration(x, y, ax, ay);
+                solver->ExactAcceleration(x, y, ex, ey);
+                double e = hypot(ax - ex, ay - ey);
+                sum += e;
+                largest = std::max(largest, e);
+                magnitude += hypot(ex, ey);
+                samples++;
+            }
+        }
+        meanError = magnitude > 0 ? sum / magnitude : 0;
+        maxError = magnitude > 0 ? largest / (magnitude / samples) : 0;
+    }
+    
+public:
+    GravityField() : solver(0), minX(0), minY(0), cellWidth(1), cellHeight(1), cells(0), valid(false), builds(0), buildSeconds(0), meanError(0), maxError(0) {}
+    
+    bool Valid() const {return valid;}
+    int Cells() const {return cells;}
+    int Builds() const {return builds;}
+    double BuildSeconds() const {return buildSeconds;}
+    float MeanError() const {return meanError;}
+    float MaxError() const {return maxError;}
+    
+    void Clear() {valid = false;}
+    
+    // samples the exact pull on a (resolution + 1)^2 grid of nodes over the area;
+    // the solver must outlive the field
+    void Build(const GravitySolver& gravity, float x0, float y0, float x1, float y1, int resolution) {
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        solver = &gravity;
+        minX = x0;
+        minY = y0;
+        cells = resolution;
+        cellWidth = (x1 - x0) / cells;
+        cellHeight = (y1 - y0) / cells;
+        int side = cells + 1;
+        field.resize(side * side * 2);
+        jobs.ParallelFor(side, 8, [&](int chunk, int begin, int end) {
+            for (int j = begin; j < end; j++) {
+                for (int i = 0; i < side; i++) {
+                    float* node = &field[(j * side + i) * 2];
+                    gravity.ExactAcceleration(minX + i * cellWidth, minY + j * cellHeight, node[0], node[1]);
+                }
+            }
+        });
+        valid = true;
+        builds++;
+        buildSeconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        MeasureError();
+    }
+    
+    // bilinear blend of the four nodes around x, y
+    void Acceleration(float x, float y, float& ax, float& ay) const {
+        float fx = (x - minX) / cellWidth, fy = (y - minY) / cellHeight;
+        if (!(fx >= 0 && fy >= 0 && fx < cells && fy < cells)) {
+            solver->Acceleration(x, y, ax, ay);
+            return;
+        }
+        int i = (int)fx, j = (int)fy;
+        float u = fx - i, v = fy - j;
+        int side = cells + 1;
+        const float* n00 = &field[(j * side + i) * 2];
+        const float* n01 = n00 + side * 2;
+        float bottomX = n00[0] + (n00[2] - n00[0]) * u, bottomY = n00[1] + (n00[3] - n00[1]) * u;
+        float topX = n01[0] + (n01[2] - n01[0]) * u, topY = n01[1] + (n01[3] - n01[1]) * u;
+        ax = bottomX + (topX - bottomX) * v;
+        ay = bottomY + (topY - bottomY) * v;
+    }
+};
+
+// the transform state of every entity, one array per field, so the loops
+// that touch all of them (gravity, broadphase, instance data) stream through
+// memory instead of chasing Object pointers; removal moves the last entity
+// into the hole and tells its owner the new index
+class EntityStore {
+public:
+    std::vector<float> positionX, positionY;
+    std::vector<float> scalingX, scalingY;
+    std::vector<float> orientation;
+    std::vector<float> velocity;
+    
+    // state at the start of the current simulation tick, blended with the
+    // current state by renderAlpha when drawing
+    std::vector<float> previousX, previousY;
+    std::vector<float> previousScalingX, previousScalingY;
+    std::vector<float> previousOrientation;
+    
+    std::vector<unsigned char> type;
+    std::vector<unsigned char> flags;
+    std::vector<unsigned char> textureIndex;
+    std::vector<Object*> owner;
+    
+    // the render transform as of the last UpdateTransforms
+    std::vector<Affine2D> transform;
+    
+private:
+    SpriteArrays staging;
+    std::vector<int> staged;
+    std::vector<float> stagedTransforms;
+    int recomputedLastFrame = 0;
+    long recomputedTotal = 0;
+    unsigned int movedTypes = 0; // bit per EntityType recomputed last frame
+    int typeCounts[ENTITY_BLACKHOLE + 1] = {};
+    
+public:
+    int Size() const {return (int)type.size();}
+    int Count(EntityType t) const {return typeCounts[t];}
+    
+    int Add(Object* o, EntityType t, vec2 position, vec2 scaling, float angle) {
+        positionX.push_back(position.x);
+        positionY.push_back(position.y);
+        scalingX.push_back(scaling.x);
+        scalingY.push_back(scaling.y);
+        orientation.push_back(angle);
+        velocity.push_back(0);
+        previousX.push_back(position.x);
+        previousY.push_back(position.y);
+        previousScalingX.push_back(scaling.x);
+        previousScalingY.push_back(scaling.y);
+        previousOrientation.push_back(angle);
+        type.push_back(t);
+        typeCounts[t]++;
+        flags.push_back(t == ENTITY_ASTEROID || t == ENTITY_HEART || t == ENTITY_EGG || t == ENTITY_SEEKER ? ENTITY_TARGET : 0);
+        textureIndex.push_back(0);
+        owner.push_back(o);
+        transform.push_back(Affine2D());
+        flags.back() |= ENTITY_MOVED;
+        return Size() - 1;
+    }
+    
+    void Remove(int e);
+    
+    // setters only mark the entity moved when the value really changes, so an
+    // entity that is told to stay put keeps its cached transform
+    void SetPosition(int e, vec2 position) {
+        if (positionX[e] == position.x && positionY[e] == position.y) return;
+        positionX[e] = position.x;
+        positionY[e] = position.y;
+        flags[e] |= ENTITY_MOVED;
+    }
+    
+    void SetScaling(int e, vec2 scaling) {
+        if (scalingX[e] == scaling.x && scalingY[e] == scaling.y) return;
+        scalingX[e] = scaling.x;
+        scalingY[e] = scaling.y;
+        flags[e] |= ENTITY_MOVED;
+    }
+    
+    void SetOrientation(int e, float angle) {
+        if (orientation[e] == angle) return;
+        orientation[e] = angle;
+        flags[e] |= ENTITY_MOVED;
+    }
+    
+    // remember where everything was before the next simulation tick
+    void SaveState() {
+        std::copy(positionX.begin(), positionX.end(), previousX.begin());
+        std::copy(positionY.begin(), positionY.end(), previousY.begin());
+        std::copy(scalingX.begin(), scalingX.end(), previousScalingX.begin());
+        std::copy(scalingY.begin(), scalingY.end(), previousScalingY.begin());
+        std::copy(orientation.begin(), orientation.end(), previousOrientation.begin());
+    }
+    
+    vec2 RenderLocation(int e, float alpha) const {
+        return vec2(previousX[e] + (positionX[e] - previousX[e]) * alpha,
+                    previousY[e] + (positionY[e] - previousY[e]) * alpha);
+    }
+    
+    vec2 RenderScaling(int e, float alpha) const {
+        return vec2(previousScalingX[e] + (scalingX[e] - previousScalingX[e]) * alpha,
+                    previousScalingY[e] + (scalingY[e] - previousScalingY[e]) * alpha);
+    }
+    
+    float RenderOrientation(int e, float alpha) const {
+        // turn the short way round so 359 -> 1 does not spin backwards
+        float delta = fmodf(orientation[e] - previousOrientation[e] + 540, 360) - 180;
+        return previousOrientation[e] + delta * alpha;
+    }
+    
+    // asteroids fall towards the black holes, each at its own speed along
+    // the direction of their summed pull; gravity is a GravitySolver or a
+    // GravityField
+    template<typename Gravity>
+    void ApplyGravity(EntityType t, const Gravity& gravity, float dt) {ApplyGravity(t, gravity, dt, 0, Size());}
+    
+    // entities in [begin, end) only, so disjoint ranges can run in parallel
+    template<typename Gravity>
+    void ApplyGravity(EntityType t, const Gravity& gravity, float dt, int begin, int end) {
+        for (int e = begin; e < end; e++) {
+            if (type[e] != t) continue;
+            float ax, ay;
+            gravity.Acceleration(positionX[e], positionY[e], ax, ay);
+            float acceleration = sqrtf(ax*ax + ay*ay);
+            if (acceleration == 0) continue;
+            velocity[e] = velocity[e] + acceleration * dt; //new velocity
+            
+            float step = velocity[e] * (dt/1000);
+            positionX[e] = positionX[e] + ax/acceleration*step;
+            positionY[e] = positionY[e] + ay/acceleration*step;
+            flags[e] |= ENTITY_MOVED;
+        }
+    }
+    
+    // quaked asteroids shrink and spin until they are gone
+    void DramaticExit() {DramaticExit(0, Size());}
+    
+    void DramaticExit(int begin, int end) {
+        for (int e = begin; e < end; e++) {
+            if (!(flags[e] & ENTITY_DRAMATIC)) continue;
+            scalingX[e] = scalingX[e] - 0.0001;
+            scalingY[e] = scalingY[e] - 0.0001;
+            orientation[e] = orientation[e] + 60;
+            flags[e] |= ENTITY_MOVED;
+        }
+    }
+    
+    bool AtRest(int e) const {
+        return positionX[e] == previousX[e] && positionY[e] == previousY[e] &&
+               scalingX[e] == previousScalingX[e] && scalingY[e] == previousScalingY[e] &&
+               orientation[e] == previousOrientation[e];
+    }
+    
+    // rebuilds the cached transform of every moved entity through the affine
+    // kernel; an entity stays moved while it is between two different tick
+    // states, since its interpolated transform changes every frame
+    void UpdateTransforms(float alpha) {
+        staging.Clear();
+        staged.clear();
+        movedTypes = 0;
+        int n = Size();
+        for (int e = 0; e < n; e++) {
+            if (!(flags[e] & ENTITY_MOVED)) continue;
+            staging.Add(RenderLocation(e, alpha), RenderScaling(e, alpha), RenderOrientation(e, alpha));
+            staged.push_back(e);
+            movedTypes |= 1u << type[e];
+            if (AtRest(e)) flags[e] &= ~ENTITY_MOVED;
+        }
+        
+        int count = staging.Size();
+        recomputedLastFrame = count;
+        recomputedTotal += count;
+        if (count == 0) return;
+        const int stride = sizeof(Affine2D) / sizeof(float);
+        stagedTransforms.resize(count * stride);
+        affineKernel.kernel(&staging.x[0], &staging.y[0], &staging.scalingX[0], &staging.scalingY[0],
+                            &staging.orientation[0], count, &stagedTransforms[0], stride);
+        for (int i = 0; i < count; i++) {
+            memcpy(&transform[staged[i]], &stagedTransforms[i * stride], sizeof(Affine2D));
+        }
+    }
+    
+    int TransformsRecomputedLastFrame() const {return recomputedLastFrame;}
+    long TransformsRecomputedTotal() const {return recomputedTotal;}
+    bool MovedLastFrame(EntityType t) const {return (movedTypes & (1u << t)) != 0;}
+    
+    // appends the cached transform and atlas region of every entity of the
+    // given type as instance records; the texture index picks the region
+    void BuildInstances(EntityType t, const AtlasRegion* regions, std::vector<float>& out) const {
+        int n = Size();
+        for (int e = 0; e < n; e++) {
+            if (type[e] != t) continue;
+            const float* a = transform[e].Floats();
+            out.insert(out.end(), a, a + 6);
+            const AtlasRegion& region = regions[textureIndex[e]];
+            out.push_back(region.u);
+            out.push_back(region.v);
+            out.push_back(region.width);
+            out.push_back(region.height);
+        }
+    }
+};
+
+EntityStore entities;
+
+class Object{
+protected:
+    Shader *shader;
+    Mesh *mesh;
+    int entity; // index into entities, kept current by EntityStore::Remove
+    
+public:
+    Object(Shader *shader, Mesh *mesh, EntityType type, vec2 position, vec2 scaling, float orientation) :
+    shader(shader), mesh(mesh) {
+        entity = entities.Add(this, type, position, scaling, orientation);
+    }
+    
+    virtual ~Object() {}
+    
+    // the camera comes from the View block, so only the model transform is per sprite
+    virtual void UploadAttributes() {
+        GetShader()->UploadModel(entities.transform[entity]);
+    }
+    
+    void Draw() {
+        UploadAttributes();
+        mesh->Draw();
+    }
+    
+    Mesh* GetMesh() {return mesh;}
+    
+    int GetEntity() {return entity;}
+    void SetEntity(int e) {entity = e;}
+    
+    vec2 GetLocation() {return vec2(entities.positionX[entity], entities.positionY[entity]);}
+    vec2 GetPreviousLocation() {return vec2(entities.previousX[entity], entities.previousY[entity]);} // at the start of this tick
+    vec2 GetScaling() {return vec2(entities.scalingX[entity], entities.scalingY[entity]);}
+    EntityType GetType() {return (EntityType)entities.type[entity];}
+    
+    void SetLocation(vec2 position) {entities.SetPosition(entity, position);}
+    void SetScaling(vec2 scaling) {entities.SetScaling(entity, scaling);}
+    void SetOrientation(float orientation) {entities.SetOrientation(entity, orientation);}
+    
+    vec2 GetRenderLocation() {return entities.RenderLocation(entity, renderAlpha);}
+    vec2 GetRenderScaling() {return entities.RenderScaling(entity, renderAlpha);}
+    float GetRenderOrientation() {return entities.RenderOrientation(entity, renderAlpha);}
+    AtlasRegion GetRegion() {return mesh->GetMaterial()->GetRegion();}
+    
+    // animated materials pick their frame from the time
+    virtual void SetTime(float time) {mesh->GetMaterial()->SetTime(time);}
+    virtual void Move(float dt, float time_lapsed) {}
+    virtual Shader* GetShader() {return shader;}
+    virtual bool ShouldBeDeleted() {return false;}
+    virtual void Control(const EntityQuery& query) {}
+    virtual void TargetHit() {}
+    virtual bool IsEnemy() {return false;}
+    virtual bool DoneExploding(float time) {return false;}
+    virtual void SetDramatic() {}
+};
+
+void EntityStore::Remove(int e) {
+    int last = Size() - 1;
+    typeCounts[type[e]]--;
+    if (e != last) {
+        positionX[e] = positionX[last];
+        positionY[e] = positionY[last];
+        scalingX[e] = scalingX[last];
+        scalingY[e] = scalingY[last];
+        orientation[e] = orientation[last];
+        velocity[e] = velocity[last];
+        previousX[e] = previousX[last];
+        previousY[e] = previousY[last];
+        previousScalingX[e] = previousScalingX[last];
+        previousScalingY[e] = previousScalingY[last];
+        previousOrientation[e] = previousOrientation[last];
+        type[e] = type[last];
+        flags[e] = flags[last];
+        textureIndex[e] = textureIndex[last];
+        owner[e] = owner[last];
+        transform[e] = transform[last];
+        if (owner[e]) owner[e]->SetEntity(e);
+    }
+    positionX.pop_back();
+    positionY.pop_back();
+    scalingX.pop_back();
+    scalingY.pop_back();
+    orientation.pop_back();
+    velocity.pop_back();
+    previousX.pop_back();
+    previousY.pop_back();
+    previousScalingX.pop_back();
+    previousScalingY.pop_back();
+    previousOrientation.pop_back();
+    type.pop_back();
+    flags.pop_back();
+    textureIndex.pop_back();
+    owner.pop_back();
+    transform.pop_back();
+}
+
+// uniform grid of projectile targets, rebuilt from their current positions
+// every tick; anything outside the bounds is clamped into the border cells.
+// Each entry also keeps where its target started the tick, for swept tests
+class SpatialGrid {
+    static const int buildGrain = 16384;
+    static const int maxCells = 1 << 14; // bounds cellStart and the per-chunk counts of Build
+    float minX, minY, cellSize;
+    int columns, rows;
+    std::vector<int> cellStart;  // targets of cell c are entries[cellStart[c] .. cellStart[c + 1])
+    std::vector<int> entries;    // entity indices, grouped by cell
+    std::vector<float> fromX, fromY, toX, toY; // each entry's motion this tick
+    float maxMotion;             // furthest any target moved along an axis this tick
+    std::vector<int> entityCell; // cell of every entity, -1 if it is not a target
+    std::vector<int> chunkNext;  // per cell and chunk: count, then next slot to fill
+    std::vector<float> chunkMotion;
+    
+    int Column(float x) const {
+        int c = (int)floorf((x - minX) / cellSize);
+        return c < 0 ? 0 : (c >= columns ? columns - 1 : c);
+    }
+    
+    int Row(float y) const {
+        int r = (int)floorf((y - minY) / cellSize);
+        return r < 0 ? 0 : (r >= rows ? rows - 1 : r);
+    }
+    
+public:
+    // an area too big for maxCells cells of the asked size gets coarser cells
+    SpatialGrid(float minX, float minY, float maxX, float maxY, float cellSize) :
+    minX(minX), minY(minY), cellSize(cellSize) {
+        float area = (maxX - minX) * (maxY - minY);
+        if (area > maxCells * cellSize * cellSize) this->cellSize = sqrtf(area / maxCells);
+        columns = std::max(1, (int)ceilf((maxX - minX) / this->cellSize));
+        rows = std::max(1, (int)ceilf((maxY - minY) / this->cellSize));
+        cellStart.assign(columns * rows + 1, 0);
+        maxMotion = 0;
+    }
+    
+    // counting sort of every target in the store: the chunks count their
+    // targets per cell in parallel, the counts become offsets, and the chunks
+    // scatter into them in parallel. Each cell keeps its targets in entity
+    // order, so the result does not depend on the thread count. A cell's
+    // counts sit side by side, so the offsets pass reads them in order
+    void Build(const EntityStore& store) {
+        int n = store.Size();
+        int cells = columns * rows;
+        int chunks = (n + buildGrain - 1) / buildGrain;
+        entityCell.resize(n);
+        chunkNext.assign(chunks * cells, 0);
+        chunkMotion.assign(chunks, 0);
+        jobs.ParallelFor(n, buildGrain, [&](int chunk, int begin, int end) {
+            int* count = &chunkNext[chunk];
+            float motion = 0;
+            for (int e = begin; e < end; e++) {
+                if (store.flags[e] & ENTITY_TARGET) {
+                    int cell = Row(store.positionY[e]) * columns + Column(store.positionX[e]);
+                    entityCell[e] = cell;
+                    count[cell * chunks]++;
+                    motion = std::max(motion, std::max(fabsf(store.positionX[e] - store.previousX[e]), fabsf(store.positionY[e] - store.previousY[e])));
+                }
+                else entityCell[e] = -1;
+            }
+            chunkMotion[chunk] = motion;
+        });
+        maxMotion = 0;
+        for (int k = 0; k < chunks; k++) maxMotion = std::max(maxMotion, chunkMotion[k]);
+        
+        int total = 0;
+        for (int c = 0; c < cells; c++) {
+            cellStart[c] = total;
+            for (int k = 0; k < chunks; k++) {
+                int count = chunkNext[c * chunks + k];
+                chunkNext[c * chunks + k] = total;
+                total += count;
+            }
+        }
+        cellStart[cells] = total;
+        
+        entries.resize(total);
+        fromX.resize(total);
+        fromY.resize(total);
+        toX.resize(total);
+        toY.resize(total);
+        jobs.ParallelFor(n, buildGrain, [&](int chunk, int begin, int end) {
+            int* next = &chunkNext[chunk];
+            for (int e = begin; e < end; e++) {
+                if (entityCell[e] < 0) continue;
+                int i = next[entityCell[e] * chunks]++;
+                entries[i] = e;
+                fromX[i] = store.previousX[e];
+                fromY[i] = store.previousY[e];
+                toX[i] = store.positionX[e];
+                toY[i] = store.positionY[e];
+            }
+        });
+    }
+    
+    // calls hit(e) for every target that came within radius of a shot moving
+    // from one point to another this tick, both moving in straight lines.
+    // Targets are filed by where they ended the tick, so the cells searched
+    // are widened by the furthest any of them moved
+    template<typename Hit>
+    void Sweep(vec2 from, vec2 to, float radius, Hit hit) const {
+        float reach = radius + maxMotion;
+        int c0 = Column(std::min(from.x, to.x) - reach), c1 = Column(std::max(from.x, to.x) + reach);
+        int r0 = Row(std::min(from.y, to.y) - reach), r1 = Row(std::max(from.y, to.y) + reach);
+        float radius2 = radius * radius;
+        const int block = 256;
+        uint32_t masks[block / 32];
+        for (int r = r0; r <= r1; r++) {
+            for (int c = c0; c <= c1; c++) {
+                int cell = r * columns + c;
+                // a cell's entries are contiguous, so the kernel reads them in place
+                for (int first = cellStart[cell]; first < cellStart[cell + 1]; first += block) {
+                    int count = std::min(block, cellStart[cell + 1] - first);
+                    narrowphaseKernel.kernel(from.x, from.y, to.x, to.y, &fromX[first], &fromY[first], &toX[first], &toY[first], count, radius2, masks);
+                    for (int w = 0; w < (count + 31) / 32; w++) {
+                        for (uint32_t bits = masks[w]; bits; bits &= bits - 1) hit(entries[first + w * 32 + CountTrailingZeros(bits)]);
+                    }
+                }
+            }
+        }
+    }
+};
+
+// what Control gets to see of the scene: the broadphase over the entity
+// store, which neither copies nor allocates. Control runs in parallel and two
+// shots may hit the same target, so hits only go into the chunk's own list;
+// the scene flags them once every chunk is done
+class EntityQuery {
+    const SpatialGrid& broadphase;
+    std::vector<int>& hits;
+    
+public:
+    EntityQuery(const SpatialGrid& broadphase, std::vector<int>& hits) : broadphase(broadphase), hits(hits) {}
+    
+    // records every target that came within radius of a shot moving from one
+    // point to another this tick as hit, returns how many; unlike a test at
+    // the end point, a fast shot cannot pass through a target between ticks
+    int HitTargetsAlong(vec2 from, vec2 to, float radius) const {
+        int count = 0;
+        broadphase.Sweep(from, to, radius, [&](int e) {
+            hits.push_back(e);
+            count++;
+        });
+        return count;
+    }
+};
+
+class AvatarObject : public Object{
+    float acceleration;
+    float invMass = 0.3;
+    float lastTime = 0;
+    float force = 1;
+    bool aPressed, dPressed, wPressed, sPressed;
+    
+public:
+    AvatarObject(Shader *shader, Mesh *mesh, vec2 position, vec2 scaling, float orientation) :
+    Object(shader, mesh, ENTITY_AVATAR, position, scaling, orientation) {
+        entities.velocity[entity] = 0.3;
+        aPressed = false;
+        dPressed = false;
+        wPressed = false;
+        sPressed = false;
+    }
+    
+    void Move(float dt, float time_lapsed) {
+        vec2 position = GetLocation();
+        float velocity = entities.velocity[entity];
+        if (keyboardState['a'] || keyboardState['d'] || keyboardState['w'] || keyboardState['s']) {
+            force = force + 2*dt;
+            acceleration = force*invMass;
+            velocity = velocity + acceleration * dt; //new velocity
+            if (keyboardState['a']) {
+                position.x = position.x - (velocity * dt);
+                aPressed = true;
+            }
             if (keyboardState['d']) {
                 position.x = position.x + (velocity * dt);
                 dPressed = true;
@@ -787,73 +2730,37 @@ public:
         }
         //float c = -force/velocity; //drag coefficient
         //velocity = velocity * exp(-dt * c * invMass); //drag
-        
-    }
-    
-    vec2 GetLocation() {
-        return position;
+        SetLocation(position);
+        entities.velocity[entity] = velocity;
     }
 };
 
 class ProjectileObject : public Object {
-    Shader *shader;
-    Mesh *mesh;
-    vec2 init_position, position, scaling;
-    float orientation;
+    vec2 init_position;
     bool deleted = false;
     
 public:
     ProjectileObject(Shader *shader, Mesh *mesh, vec2 position, vec2 scaling, float orientation) :
-    Object(shader, mesh, position, scaling, orientation), shader(shader), mesh(mesh), position(position), scaling(scaling), orientation(orientation) {
+    Object(shader, mesh, ENTITY_PROJECTILE, position, scaling, orientation) {
         init_position = position;
     }
     
-    void UploadAttributes() {
-        mat4 S = {scaling.x,0,0,0,
-            0,scaling.y,0,0,
-            0,0,1,0,
-            0,0,0,1};
-        
-        float radians = orientation/180*M_PI;
-        mat4 R = {cos(radians),sin(radians),0,0,
-            -sin(radians),cos(radians),0,0,
-            0,0,1,0,
-            0,0,0,1};
-        
-        mat4 T = {1,0,0,0,
-            0,1,0,0,
-            0,0,1,0,
-            position.x,position.y,0,1};
-        
-        mat4 V = camera.GetViewTransformationMatrix();
-        mat4 M = S * R * T * V; // scaling, rotation, and translation
-        shader->UploadM(M);
-    }
-    
-    vec2 GetLocation() {return position;}
-    
     void Move(float dt, float time_lapsed) {
+        vec2 position = GetLocation();
         position.y = position.y + dt*2;
         if (position.y > init_position.y + 1) {
             deleted = true;
         }
+        SetLocation(position);
     }
   
     bool ShouldBeDeleted() {
         return deleted;
     }
     
-    void Control(std::vector<Object*> objects, int me,
-                 std::vector<std::vector<Object*>> asteroid_objects) {
-        for(int i = 0; i < objects.size(); i++) {
-            if(i != me) {
-                objects[i]->HitByProjectile(this);
-            }
-        }
-        for(int i = 0; i < asteroid_objects.size(); i++) {
-            for(int j = 0; j < asteroid_objects[i].size(); j++) {
-                asteroid_objects[i][j]->HitByProjectile(this);
-            }
+    void Control(const EntityQuery& query) {
+        if (query.HitTargetsAlong(GetPreviousLocation(), GetLocation(), projectileHitRadius) > 0) {
+            TargetHit();
         }
     }
     
@@ -864,67 +2771,33 @@ public:
 };
 
 class FireballObject : public Object {
-    Shader *shader;
-    Mesh *mesh;
-    vec2 init_position, position, scaling;
-    float orientation;
+    vec2 init_position;
     bool deleted = false;
     vec2 norm_path;
     
 public:
     FireballObject(Shader *shader, Mesh *mesh, vec2 position, vec2 scaling, float orientation, vec2 norm_path) :
-    Object(shader, mesh, position, scaling, orientation), shader(shader), mesh(mesh), position(position), scaling(scaling), orientation(orientation), norm_path(norm_path) {
+    Object(shader, mesh, ENTITY_FIREBALL, position, scaling, orientation), norm_path(norm_path) {
         init_position = position;
     }
     
-    void UploadAttributes() {
-        mat4 S = {scaling.x,0,0,0,
-            0,scaling.y,0,0,
-            0,0,1,0,
-            0,0,0,1};
-        
-        float radians = orientation/180*M_PI;
-        mat4 R = {cos(radians),sin(radians),0,0,
-            -sin(radians),cos(radians),0,0,
-            0,0,1,0,
-            0,0,0,1};
-        
-        mat4 T = {1,0,0,0,
-            0,1,0,0,
-            0,0,1,0,
-            position.x,position.y,0,1};
-        
-        mat4 V = camera.GetViewTransformationMatrix();
-        mat4 M = S * R * T * V; // scaling, rotation, and translation
-        shader->UploadM(M);
-    }
-    
-    vec2 GetLocation() {return position;}
-    
     void Move(float dt, float time_lapsed) {
-        position = position + norm_path*dt*2;
+        vec2 position = GetLocation() + norm_path*dt*2;
         //printf("%f", dt);
         if (position.y > init_position.y+1.5 || position.y < init_position.y-1.5 ||
             position.x > init_position.x+1.5 || position.x < init_position.x-1.5) {
             deleted = true;
         }
+        SetLocation(position);
     }
     
     bool ShouldBeDeleted() {
         return deleted;
     }
     
-    void Control(std::vector<Object*> objects, int me,
-                 std::vector<std::vector<Object*>> asteroid_objects) {
-        for(int i = 0; i < objects.size(); i++) {
-            if(i != me) {
-                objects[i]->HitByProjectile(this);
-            }
-        }
-        for(int i = 0; i < asteroid_objects.size(); i++) {
-            for(int j = 0; j < asteroid_objects[i].size(); j++) {
-                asteroid_objects[i][j]->HitByProjectile(this);
-            }
+    void Control(const EntityQuery& query) {
+        if (query.HitTargetsAlong(GetPreviousLocation(), GetLocation(), projectileHitRadius) > 0) {
+            TargetHit();
         }
     }
     
@@ -934,209 +2807,65 @@ public:
     
 };
 
+// asteroids are moved in bulk by EntityStore::ApplyGravity and DramaticExit
 class EnemyObject : public Object{
-    Shader *shader;
-    Mesh *mesh;
-    vec2 position, scaling;
-    float orientation;
-    bool deleted = false;
-    bool dramatic = false;
-    bool enemy = true;
-    float velocity = 0.0001;
     
 public:
-    EnemyObject(Shader *shader, Mesh *mesh, vec2 position, vec2 scaling, float orientation) :
-    Object(shader, mesh, position, scaling, orientation), shader(shader), mesh(mesh), position(position), scaling(scaling), orientation(orientation) {}
-    
-    void UploadAttributes() {
-        mat4 S = {scaling.x,0,0,0,
-            0,scaling.y,0,0,
-            0,0,1,0,
-            0,0,0,1};
-        
-        float radians = orientation/180*M_PI;
-        mat4 R = {cos(radians),sin(radians),0,0,
-            -sin(radians),cos(radians),0,0,
-            0,0,1,0,
-            0,0,0,1};
-        
-        mat4 T = {1,0,0,0,
-            0,1,0,0,
-            0,0,1,0,
-            position.x,position.y,0,1};
-        
-        mat4 V = camera.GetViewTransformationMatrix();
-        mat4 M = S * R * T * V; // scaling, rotation, and translation
-        shader->UploadM(M);
-    }
-    
-    void HitByProjectile(Object* projectile) {
-        vec2 dist = position - projectile->GetLocation();
-        float radius = 0.2; //change later
-        if (dist.length() < radius) {
-            deleted = true;
-            projectile->TargetHit();
-        }
+    EnemyObject(Shader *shader, Mesh *mesh, vec2 position, vec2 scaling, float orientation, int textureIndex = 0) :
+    Object(shader, mesh, ENTITY_ASTEROID, position, scaling, orientation) {
+        entities.velocity[entity] = 0.0001;
+        entities.textureIndex[entity] = textureIndex;
     }
     
     bool ShouldBeDeleted() {
+        vec2 scaling = GetScaling();
         if (scaling.x < 0.01 || scaling.y < 0.01) {
-            deleted = true;
+            entities.flags[entity] |= ENTITY_HIT;
         }
-        return deleted;
+        return (entities.flags[entity] & ENTITY_HIT) != 0;
     }
     
-    bool IsEnemy() {return enemy;}
+    bool IsEnemy() {return !(entities.flags[entity] & ENTITY_DRAMATIC);}
     
     void SetDramatic() {
-        dramatic = true;
-        enemy = false;
-    }
-    
-    void DramaticExit() {
-        if (dramatic) {
-            scaling = scaling - vec2(0.0001, 0.0001);
-            orientation = orientation + 60;
-        }
-    }
-    
-    vec2 GetLocation() {return position;}
-    
-    void Move(float dt, float time_lapsed) {
-        if (blackHolePlaced) {
-            vec2 path = blackHolePos - position;
-            
-            float m1 = 40; //blackhole mass
-            float m2 = 0.5; //asteroid mass
-            float r = path.length()*100;
-            float force = 9.81*((m1*m2)/r*r); //law of gravitation
-            
-            float acceleration = force*(1/m2);
-            velocity = velocity + acceleration * dt; //new velocity
-            
-            vec2 norm_path = vec2(path.x/path.length(), path.y/path.length());
-            position = position + norm_path*(velocity * (dt/1000));
-        }
+        entities.flags[entity] |= ENTITY_DRAMATIC;
     }
 };
 
 class EnemyMovingHeartObject : public Object{
-    Shader *shader;
-    Mesh *mesh;
-    vec2 position, scaling;
-    float orientation;
-    bool deleted = false;
     
 public:
     EnemyMovingHeartObject(Shader *shader, Mesh *mesh, vec2 position, vec2 scaling, float orientation) :
-    Object(shader, mesh, position, scaling, orientation), shader(shader), mesh(mesh), position(position), scaling(scaling), orientation(orientation) {}
-    
-    void UploadAttributes() {
-        mat4 S = {scaling.x,0,0,0,
-            0,scaling.y,0,0,
-            0,0,1,0,
-            0,0,0,1};
-        
-        float radians = orientation/180*M_PI;
-        mat4 R = {cos(radians),sin(radians),0,0,
-            -sin(radians),cos(radians),0,0,
-            0,0,1,0,
-            0,0,0,1};
-        
-        mat4 T = {1,0,0,0,
-            0,1,0,0,
-            0,0,1,0,
-            position.x,position.y,0,1};
-        
-        mat4 V = camera.GetViewTransformationMatrix();
-        mat4 M = S * R * T * V; // scaling, rotation, and translation
-        shader->UploadM(M);
-    }
-    
-    void HitByProjectile(Object* projectile) {
-        vec2 dist = position - projectile->GetLocation();
-        float radius = 0.2; //change later
-        if (dist.length() < radius) {
-            deleted = true;
-            projectile->TargetHit();
-        }
-    }
-    
-    vec2 GetLocation() {return position;}
-    
-    void SetTime(float time) {
-        shader->Run();
-        shader->UploadTime(time);
-    }
+    Object(shader, mesh, ENTITY_HEART, position, scaling, orientation) {}
     
     bool ShouldBeDeleted() {
-        return deleted;
+        return (entities.flags[entity] & ENTITY_HIT) != 0;
     }
     
     void Move(float dt, float time_lapsed) {
         float t = time_lapsed/2;
         float scale = 15.0;
+        vec2 position;
         position.x = (16 * pow(sinf(t), 3.0))/scale;
         position.y = (13 * cosf(t) - 5 * cosf(2*t) - 2 * cosf(3*t) - cosf(4*t))/scale;
+        SetLocation(position);
     }
     
     bool IsEnemy() {return true;}
 };
 
 class EnemyMovingEggObject : public Object{
-    Shader *shader;
-    Mesh *mesh;
-    vec2 position, scaling;
-    float orientation;
-    bool deleted = false;
     
 public:
     EnemyMovingEggObject(Shader *shader, Mesh *mesh, vec2 position, vec2 scaling, float orientation) :
-    Object(shader, mesh, position, scaling, orientation), shader(shader), mesh(mesh), position(position), scaling(scaling), orientation(orientation) {}
-    
-    void UploadAttributes() {
-        mat4 S = {scaling.x,0,0,0,
-            0,scaling.y,0,0,
-            0,0,1,0,
-            0,0,0,1};
-        
-        float radians = orientation/180*M_PI;
-        mat4 R = {cos(radians),sin(radians),0,0,
-            -sin(radians),cos(radians),0,0,
-            0,0,1,0,
-            0,0,0,1};
-        
-        mat4 T = {1,0,0,0,
-            0,1,0,0,
-            0,0,1,0,
-            position.x,position.y,0,1};
-        
-        mat4 V = camera.GetViewTransformationMatrix();
-        mat4 M = S * R * T * V; // scaling, rotation, and translation
-        shader->UploadM(M);
-    }
-    
-    void HitByProjectile(Object* projectile) {
-        vec2 dist = position - projectile->GetLocation();
-        float radius = 0.2; //change later
-        if (dist.length() < radius) {
-            deleted = true;
-            projectile->TargetHit();
-        }
-    }
-    
-    vec2 GetLocation() {return position;}
-    
-    void SetTime(float time) {
-        shader->Run();
-        shader->UploadTime(time);
-    }
+    Object(shader, mesh, ENTITY_EGG, position, scaling, orientation) {}
     
     bool ShouldBeDeleted() {
-        return deleted;
+        return (entities.flags[entity] & ENTITY_HIT) != 0;
     }
     
     void Move(float dt, float time_lapsed) {
+        vec2 position = GetLocation();
         float t = time_lapsed/2;
         float k = 2;
         float new_position_x = cosf(k*t)*cosf(t);
@@ -1146,88 +2875,45 @@ public:
         vec2 norm_direction = vec2(direction.x/direction.length(), direction.y/direction.length());
         // dot products
         if (norm_direction.x < 0) {
-            orientation = 180 + acos(norm_direction.y)*(180/M_PI);
+            SetOrientation(180 + acos(norm_direction.y)*(180/M_PI));
         }
         else if (norm_direction.x > 0) {
-            orientation = 180 - acos(norm_direction.y)*(180/M_PI);
+            SetOrientation(180 - acos(norm_direction.y)*(180/M_PI));
         }
         
-        position.x = new_position_x;
-        position.y = new_position_y;
+        SetLocation(vec2(new_position_x, new_position_y));
     }
     
     bool IsEnemy() {return true;}
 };
 
 class SeekerObject : public Object{
-    Shader *shader;
-    Mesh *mesh;
-    vec2 position, scaling;
-    float orientation;
-    bool deleted = false;
     Object* avatar;
     
 public:
     SeekerObject(Shader *shader, Mesh *mesh, vec2 position, vec2 scaling, float orientation, Object* avatar) :
-    Object(shader, mesh, position, scaling, orientation), shader(shader), mesh(mesh), position(position), scaling(scaling), orientation(orientation), avatar(avatar) {}
-    
-    void UploadAttributes() {
-        mat4 S = {scaling.x,0,0,0,
-            0,scaling.y,0,0,
-            0,0,1,0,
-            0,0,0,1};
-        
-        float radians = orientation/180*M_PI;
-        mat4 R = {cos(radians),sin(radians),0,0,
-            -sin(radians),cos(radians),0,0,
-            0,0,1,0,
-            0,0,0,1};
-        
-        mat4 T = {1,0,0,0,
-            0,1,0,0,
-            0,0,1,0,
-            position.x,position.y,0,1};
-        
-        mat4 V = camera.GetViewTransformationMatrix();
-        mat4 M = S * R * T * V; // scaling, rotation, and translation
-        shader->UploadM(M);
-    }
-    
-    void HitByProjectile(Object* projectile) {
-        vec2 dist = position - projectile->GetLocation();
-        float radius = 0.2; //change later
-        if (dist.length() < radius) {
-            deleted = true;
-            projectile->TargetHit();
-        }
-    }
-    
-    vec2 GetLocation() {return position;}
-    
-    void SetTime(float time) {
-        shader->Run();
-        shader->UploadTime(time);
-    }
+    Object(shader, mesh, ENTITY_SEEKER, position, scaling, orientation), avatar(avatar) {}
     
     bool ShouldBeDeleted() {
-        return deleted;
+        return (entities.flags[entity] & ENTITY_HIT) != 0;
     }
     
     void Move(float dt, float time_lapsed) {
         
+        vec2 position = GetLocation();
         vec2 path = avatar->GetLocation() - position;
         if (abs(path.x) > 0.1 || abs(path.y) > 0.1) {
             vec2 norm_path = vec2(path.x/path.length(), path.y/path.length());
             
             // dot products
             if (norm_path.x < 0) {
-                orientation = 270 + acos(norm_path.y)*(180/M_PI);
+                SetOrientation(270 + acos(norm_path.y)*(180/M_PI));
             }
             else if (norm_path.x > 0) {
-                orientation = 270 - acos(norm_path.y)*(180/M_PI);
+                SetOrientation(270 - acos(norm_path.y)*(180/M_PI));
             }
             
-            position = position + norm_path*(dt/5)*2;
+            SetLocation(position + norm_path*(dt/5)*2);
         }
     }
     
@@ -1235,364 +2921,721 @@ public:
 };
 
 class ExplodingObject : public Object{
-    Shader *shader;
-    Mesh *mesh;
-    vec2 position, scaling;
-    float orientation;
-    bool deleted = false;
     float start_time;
     float time_lapsed;
     
 public:
     ExplodingObject(Shader *shader, Mesh *mesh, vec2 position, vec2 scaling, float orientation, float start_time, float time_lapsed) :
-    Object(shader, mesh, position, scaling, orientation), shader(shader), mesh(mesh), position(position), scaling(scaling), orientation(orientation), start_time(start_time), time_lapsed(time_lapsed) {}
+    Object(shader, mesh, ENTITY_EXPLOSION, position, scaling, orientation), start_time(start_time), time_lapsed(time_lapsed) {}
     
-    void UploadAttributes() {
-        mat4 S = {scaling.x,0,0,0,
-            0,scaling.y,0,0,
-            0,0,1,0,
-            0,0,0,1};
-        
-        float radians = orientation/180*M_PI;
-        mat4 R = {cos(radians),sin(radians),0,0,
-            -sin(radians),cos(radians),0,0,
-            0,0,1,0,
-            0,0,0,1};
+    void SetTime(float time) {
+        mesh->GetMaterial()->SetTime(time*1.5);
+    }
+    
+    bool DoneExploding(float time) {
+        int start_i = (int)floor(time_lapsed * 10) % 36;
+        int i = (int)floor(time * 10) % 36;
+        if ((start_i-1)%36 == i || (time - time_lapsed) > 3.4) {
+            return true;
+        }
+        else return false;
+    }
+};
+
+class BlackHoleObject : public Object{
+    
+public:
+    BlackHoleObject(Shader *shader, Mesh *mesh, vec2 position, vec2 scaling, float orientation) :
+    Object(shader, mesh, ENTITY_BLACKHOLE, position, scaling, orientation) {}
+};
+
+// collects sprites and draws them with the instanced
+// quad; a flush is one draw call for up to maxSprites sprites, so the number
+// of draws does not grow with the number of sprites on screen
+class SpriteBatch {
+    Shader* shader;
+    InstancedTexturedQuad* quad;
+    Texture* atlas;
+    std::vector<float> instanceData;
+    
+public:
+    static const int maxSprites = 4096;
+    
+    SpriteBatch(Shader* shader, InstancedTexturedQuad* quad, Texture* atlas) :
+    shader(shader), quad(quad), atlas(atlas) {
+        instanceData.reserve(maxSprites * InstancedTexturedQuad::instanceFloats);
+    }
+    
+    int Count() const {return (int)instanceData.size() / InstancedTexturedQuad::instanceFloats;}
+    
+    void Add(const Affine2D& transform, AtlasRegion region) {
+        instanceData.insert(instanceData.end(), transform.Floats(), transform.Floats() + 6);
+        instanceData.push_back(region.u);
+        instanceData.push_back(region.v);
+        instanceData.push_back(region.width);
+        instanceData.push_back(region.height);
+        if (Count() >= maxSprites) Flush();
+    }
+    
+    // every entity of one type straight from the store
+    void AddEntities(const EntityStore& store, EntityType type, const AtlasRegion* regions) {
+        store.BuildInstances(type, regions, instanceData);
+        if (Count() >= maxSprites) Flush();
+    }
+    
+    void Flush() {
+        int count = Count();
+        if (count == 0) return;
         
-        mat4 T = {1,0,0,0,
-            0,1,0,0,
-            0,0,1,0,
-            position.x,position.y,0,1};
+        shader->Run();
+        shader->UploadSamplerID();
+        atlas->Bind();
         
-        mat4 V = camera.GetViewTransformationMatrix();
-        mat4 M = S * R * T * V; // scaling, rotation, and translation
-        shader->UploadM(M);
+        for (int first = 0; first < count; first += maxSprites) {
+            int n = count - first;
+            if (n > maxSprites) n = maxSprites;
+            quad->UploadInstances(&instanceData[first * InstancedTexturedQuad::instanceFloats], n);
+            quad->DrawInstanced(n);
+        }
+        instanceData.clear();
+    }
+};
+
+// sprites that rarely change drawn once into a screen-sized texture, then
+// put on screen with one quad per frame until Invalidate is called
+class StaticLayer {
+    unsigned int framebuffer;
+    Texture* color;
+    CompositeShader* shader;
+    TexturedQuad* quad;
+    bool valid;
+    int rebuilds;
+    int width, height;
+    
+    void Attach() {
+        color = new Texture(width, height, NULL);
+        glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, color->GetId(), 0);
+        if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) printf("static layer framebuffer is incomplete\n");
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    }
+    
+public:
+    StaticLayer(CompositeShader* shader, TexturedQuad* quad, int width, int height) :
+    shader(shader), quad(quad), valid(false), rebuilds(0), width(width), height(height) {
+        glGenFramebuffers(1, &framebuffer);
+        Attach();
+    }
+    
+    ~StaticLayer() {
+        glDeleteFramebuffers(1, &framebuffer);
+        delete color;
+    }
+    
+    void Invalidate() {valid = false;}
+    bool Valid() {return valid;}
+    int Rebuilds() {return rebuilds;}
+    
+    // the layer covers the whole viewport, so it follows the window size
+    void Resize(int newWidth, int newHeight) {
+        if (newWidth == width && newHeight == height) return;
+        width = newWidth;
+        height = newHeight;
+        delete color;
+        Attach();
+        valid = false;
+    }
+    
+    // whatever is drawn between these two goes into the layer
+    void BeginRebuild() {
+        glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+        glClearColor(0, 0, 0, 0);
+        glClear(GL_COLOR_BUFFER_BIT);
+    }
+    
+    void EndRebuild() {
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+        valid = true;
+        rebuilds++;
+    }
+    
+    void Composite() {
+        shader->Run();
+        shader->UploadSamplerID();
+        color->Bind();
+        quad->DrawPremultiplied();
+    }
+};
+
+// one sprite waiting to be drawn
+struct DrawItem {
+    uint64_t key;
+    Object* object;
+};
+
+// sprites gathered for a frame and ordered by a 64-bit key before any are
+// drawn. From the top bit down the key holds:
+//   layer    4 bits   back to front, so blending between layers stays correct
+//   shader  12 bits   program id
+//   texture 24 bits   texture id
+//   order   24 bits   submission order, keeps the sort deterministic
+// Sprites of one layer are the same kind of thing and are treated as
+// unordered among themselves, which is what lets shader and texture
+// switches be grouped.
+class DrawList {
+    std::vector<DrawItem> items;
+    std::vector<DrawItem> scratch;
+    
+public:
+    // asteroids are drawn first and the explosions over everything
+    static int Layer(EntityType type) {
+        switch (type) {
+            case ENTITY_ASTEROID: return 0;
+            case ENTITY_BLACKHOLE: return 1;
+            case ENTITY_HEART:
+            case ENTITY_EGG:
+            case ENTITY_SEEKER: return 2;
+            case ENTITY_AVATAR: return 3;
+            case ENTITY_PROJECTILE:
+            case ENTITY_FIREBALL: return 4;
+            case ENTITY_EXPLOSION: return 5;
+        }
+        return 15;
     }
     
-    void SetTime(float time) {
-        shader->Run();
-        shader->UploadTime(time*1.5);
+    static uint64_t Key(int layer, unsigned int shader, unsigned int texture, unsigned int order) {
+        return ((uint64_t)(layer & 0xF) << 60) | ((uint64_t)(shader & 0xFFF) << 48) |
+               ((uint64_t)(texture & 0xFFFFFF) << 24) | (uint64_t)(order & 0xFFFFFF);
+    }
+    
+    void Clear() {items.clear();}
+    int Size() const {return (int)items.size();}
+    const DrawItem& operator[](int i) const {return items[i];}
+    
+    void Add(uint64_t key, Object* object) {
+        DrawItem item = {key, object};
+        items.push_back(item);
+    }
+    
+    // least significant byte first, one counting pass per byte; bytes that
+    // are the same in every key are skipped
+    void Sort() {
+        int n = (int)items.size();
+        scratch.resize(n);
+        for (int shift = 0; shift < 64; shift += 8) {
+            int count[257] = {0};
+            for (int i = 0; i < n; i++) count[((items[i].key >> shift) & 0xFF) + 1]++;
+            if (n == 0 || count[((items[0].key >> shift) & 0xFF) + 1] == n) continue;
+            for (int b = 0; b < 256; b++) count[b + 1] += count[b];
+            for (int i = 0; i < n; i++) scratch[count[(items[i].key >> shift) & 0xFF]++] = items[i];
+            items.swap(scratch);
+        }
+    }
+};
+
+// slot counts for the short-lived entity pools, set before the Scene is built
+struct PoolCaps {
+    int projectiles;
+    int fireballs;
+    int explosions;
+};
+
+PoolCaps poolCaps = {8, 128, 64};
+
+// asteroids per side of the starting grid
+int asteroidGridSize = 6;
+
+class PoolBase {
+public:
+    virtual ~PoolBase() {}
+    virtual void Release(int slot) = 0;
+};
+
+// fixed number of slots for one kind of short-lived entity; every slot keeps
+// its material and mesh for the life of the pool and its object is
+// constructed in place, so spawning neither allocates nor touches GL
+template<typename T>
+class EntityPool : public PoolBase {
+    typedef typename std::aligned_storage<sizeof(T), alignof(T)>::type Storage;
+    
+    const char* name;
+    Shader* shader;
+    std::vector<Storage> storage;
+    std::vector<Material*> materials;
+    std::vector<Mesh*> meshes;
+    std::vector<int> freeSlots;
+    int highWater = 0;
+    int spawned = 0;
+    int rejected = 0;
+    
+public:
+    EntityPool(const char* name) : name(name), shader(0) {}
+    
+    ~EntityPool() {
+        for(size_t i = 0; i < materials.size(); i++) delete materials[i];
+        for(size_t i = 0; i < meshes.size(); i++) delete meshes[i];
     }
     
-    bool DoneExploding(float time) {
-        int start_i = (int)floor(time_lapsed * 10) % 36;
-        int i = (int)floor(time * 10) % 36;
-        if ((start_i-1)%36 == i || (time - time_lapsed) > 3.4) {
-            return true;
+    // makeMaterial() is called once per slot
+    template<typename MakeMaterial>
+    void Initialize(int capacity, Shader* shader, MakeMaterial makeMaterial) {
+        this->shader = shader;
+        storage.resize(capacity);
+        for (int i = 0; i < capacity; i++) {
+            materials.push_back(makeMaterial());
+            meshes.push_back(new Mesh(geometryRegistry.Sprite(), materials[i]));
         }
-        else return false;
+        for (int i = capacity - 1; i >= 0; i--) freeSlots.push_back(i);
     }
-};
-
-class BlackHoleObject : public Object{
-    Shader *shader;
-    Mesh *mesh;
-    vec2 position, scaling;
-    float orientation;
     
-public:
-    BlackHoleObject(Shader *shader, Mesh *mesh, vec2 position, vec2 scaling, float orientation) :
-    Object(shader, mesh, position, scaling, orientation), shader(shader), mesh(mesh), position(position), scaling(scaling), orientation(orientation) {}
+    // builds a T from (shader, mesh, args...) in a free slot; null when every
+    // slot is in use
+    template<typename... Args>
+    T* Spawn(int& slot, Args... args) {
+        if (freeSlots.empty()) {
+            rejected++;
+            return 0;
+        }
+        slot = freeSlots.back();
+        freeSlots.pop_back();
+        spawned++;
+        highWater = std::max(highWater, Live());
+        return new (&storage[slot]) T(shader, meshes[slot], args...);
+    }
     
-    void UploadAttributes() {
-        mat4 S = {scaling.x,0,0,0,
-            0,scaling.y,0,0,
-            0,0,1,0,
-            0,0,0,1};
-        
-        float radians = orientation/180*M_PI;
-        mat4 R = {cos(radians),sin(radians),0,0,
-            -sin(radians),cos(radians),0,0,
-            0,0,1,0,
-            0,0,0,1};
-        
-        mat4 T = {1,0,0,0,
-            0,1,0,0,
-            0,0,1,0,
-            position.x,position.y,0,1};
-        
-        mat4 V = camera.GetViewTransformationMatrix();
-        mat4 M = S * R * T * V; // scaling, rotation, and translation
-        shader->UploadM(M);
+    void Release(int slot) {
+        reinterpret_cast<T*>(&storage[slot])->~T();
+        freeSlots.push_back(slot);
     }
     
-    bool IsBlackHole() {return true;}
+    int Capacity() const {return (int)storage.size();}
+    int Live() const {return Capacity() - (int)freeSlots.size();}
+    
+    void PrintStats() const {
+        printf("%-12s %d/%d in use, high water %d, %d spawned, %d rejected\n", name, Live(), Capacity(), highWater, spawned, rejected);
+    }
+};
+
+// everything one scene entity owns; Scene::Remove frees all of it, or hands
+// the object back to its pool
+struct SceneEntity {
+    Object* object;
+    Mesh* mesh;
+    Material* material;
+    PoolBase* pool;
+    int poolSlot;
+    
+    SceneEntity() : object(0), mesh(0), material(0), pool(0), poolSlot(-1) {}
+    SceneEntity(Object* object, Mesh* mesh, Material* material) :
+    object(object), mesh(mesh), material(material), pool(0), poolSlot(-1) {}
 };
 
 class Scene {
     TexturedShader* textureShader;
     AnimatedTexturedShader* animatedShader;
-    int asteroid_dim = 6;
-    
-    std::vector<Material*> materials;
-    std::vector<Geometry*> geometries;
-    std::vector<Mesh*> meshes;
-    std::vector<Object*> objects;
+    InstancedTexturedShader* instancedShader;
+    SpriteBatch* batch;
+    StaticLayer* asteroidLayer;
+    std::vector<AtlasRegion> asteroid_regions;
+    int asteroid_dim = asteroidGridSize;
+    bool batchSprites = true;
+    bool cacheAsteroids = true; // needs batchSprites
+    bool asteroidRemoved = false;
+    SpatialGrid broadphase;
+    DrawList drawList;
+    
+    SlotMap<SceneEntity> records;
+    
+    // what the deletion pass found in one chunk of records
+    struct Removal {
+        Handle handle;
+        bool explode;
+        vec2 position;
+    };
+    std::vector<std::vector<Removal> > chunkRemovals; // kept between ticks so they never reallocate
+    std::vector<std::vector<int> > chunkHits; // entity indices each chunk's shots hit, kept the same way
+    Handle avatar;
+    std::vector<Handle> blackHoles;
+    GravitySolver gravity;
+    GravityField gravityField;
+    
+    EntityPool<ProjectileObject> projectiles;
+    EntityPool<FireballObject> fireballs;
+    EntityPool<ExplodingObject> explosions;
     
-    std::vector<Material*> asteroid_materials;
-    std::vector<Geometry*> asteroid_geometries;
-    std::vector<Mesh*> asteroid_meshes;
-    std::vector<std::vector<Object*>> asteroid_objects;
 public:
-    Scene() {
+    // grid cells match the asteroid lattice spacing and cover the lattice
+    // with room for the avatar, the enemies and the black holes around it.
+    // asteroid_dim is declared before broadphase, so it is already set here
+    Scene() : broadphase(-2, -2, std::max(2.0f, -0.75f + 0.3f * (asteroid_dim - 1) + 1), std::max(2.0f, -0.4f + 0.3f * (asteroid_dim - 1) + 1), 0.3), projectiles("projectiles"), fireballs("fireballs"), explosions("explosions") {
         textureShader = 0;
         animatedShader = 0;
+        instancedShader = 0;
+        batch = 0;
+        asteroidLayer = 0;
     }
     void Initialize() {
         
-        textureShader = new TexturedShader();
-        animatedShader = new AnimatedTexturedShader();
+        gravity.SetTheta(gravityTheta);
+        textureShader = shaderRegistry.Textured();
+        animatedShader = shaderRegistry.Animated();
+        instancedShader = shaderRegistry.Instanced();
         
         //add avatar
-        Texture* t = new Texture("/Users/Tongyu/Documents/AIT_Budapest/Graphics/Galaxy/Galaxy/spaceship.png");
-        materials.push_back(new TextureMaterial(textureShader, vec4(1, 0, 0), t));
-        geometries.push_back(new TexturedQuad());
-        meshes.push_back(new Mesh(geometries[0], materials[0]));
-        objects.push_back(new AvatarObject(textureShader, meshes[0], vec2(0, -0.75), vec2(0.8,0.8), 180));
-        
-        Texture* t1 = new Texture("/Users/Tongyu/Documents/AIT_Budapest/Graphics/Galaxy/Galaxy/orb.png");
-        materials.push_back(new AnimatedTexturedMaterial(animatedShader, vec4(1, 0, 0), t1, 5));
-        geometries.push_back(new TexturedQuad());
-        meshes.push_back(new Mesh(geometries[1], materials[1]));
-        objects.push_back(new EnemyMovingHeartObject(animatedShader, meshes[1], vec2(-1.2,0.9), vec2(0.2,0.2), 0));
-        
-        Texture* t2 = new Texture("/Users/Tongyu/Documents/AIT_Budapest/Graphics/Galaxy/Galaxy/rocket.png");
-        materials.push_back(new TextureMaterial(textureShader, vec4(1, 0, 0), t2));
-        geometries.push_back(new TexturedQuad());
-        meshes.push_back(new Mesh(geometries[2], materials[2]));
-        objects.push_back(new EnemyMovingEggObject(textureShader, meshes[2], vec2(-1.2,0.9), vec2(0.3,0.3), 0));
-        
-        Texture* t3 = new Texture("/Users/Tongyu/Documents/AIT_Budapest/Graphics/Galaxy/Galaxy/fish.png");
-        materials.push_back(new TextureMaterial(textureShader, vec4(1, 0, 0), t3));
-        geometries.push_back(new TexturedQuad());
-        meshes.push_back(new Mesh(geometries[3], materials[3]));
-        objects.push_back(new SeekerObject(textureShader, meshes[3], vec2(-1.2,0.9), vec2(0.2,0.2), 270, objects[0]));
+        Texture* atlas = spriteAtlas.GetTexture();
+        Material* material = new TextureMaterial(textureShader, vec4(1, 0, 0), atlas, spriteAtlas.Region("spaceship.png"));
+        Mesh* mesh = new Mesh(geometryRegistry.Sprite(), material);
+        Object* avatarObject = new AvatarObject(textureShader, mesh, vec2(0, -0.75), vec2(0.8,0.8), 180);
+        avatar = Add(avatarObject, mesh, material);
+        
+        material = new AnimatedTexturedMaterial(animatedShader, vec4(1, 0, 0), atlas, spriteAtlas.Region("orb.png"), 5);
+        mesh = new Mesh(geometryRegistry.Sprite(), material);
+        Add(new EnemyMovingHeartObject(animatedShader, mesh, vec2(-1.2,0.9), vec2(0.2,0.2), 0), mesh, material);
+        
+        material = new TextureMaterial(textureShader, vec4(1, 0, 0), atlas, spriteAtlas.Region("rocket.png"));
+        mesh = new Mesh(geometryRegistry.Sprite(), material);
+        Add(new EnemyMovingEggObject(textureShader, mesh, vec2(-1.2,0.9), vec2(0.3,0.3), 0), mesh, material);
+        
+        material = new TextureMaterial(textureShader, vec4(1, 0, 0), atlas, spriteAtlas.Region("fish.png"));
+        mesh = new Mesh(geometryRegistry.Sprite(), material);
+        Add(new SeekerObject(textureShader, mesh, vec2(-1.2,0.9), vec2(0.2,0.2), 270, avatarObject), mesh, material);
+        
+        // short-lived effects come from pools built up front, so spawning
+        // them never allocates
+        TexturedShader* shader = textureShader;
+        AnimatedTexturedShader* animated = animatedShader;
+        AtlasRegion bullet = spriteAtlas.Region("bullet.png");
+        AtlasRegion fireball = spriteAtlas.Region("fireball.png");
+        AtlasRegion boom = spriteAtlas.Region("boom.png");
+        projectiles.Initialize(poolCaps.projectiles, shader, [=]() -> Material* {
+            return new TextureMaterial(shader, vec4(1, 0, 0), atlas, bullet);
+        });
+        fireballs.Initialize(poolCaps.fireballs, shader, [=]() -> Material* {
+            return new TextureMaterial(shader, vec4(1, 0, 0), atlas, fireball);
+        });
+        explosions.Initialize(poolCaps.explosions, animated, [=]() -> Material* {
+            return new AnimatedTexturedMaterial(animated, vec4(1, 0, 0), atlas, boom, 6);
+        });
         
         //add enemies
+        const char* asteroid_images[] = {"asteroid.png", "asteroid1.png", "asteroid2.png", "asteroid3.png"};
+        for (int i = 0; i < 4; i++) {
+            asteroid_regions.push_back(spriteAtlas.Region(asteroid_images[i]));
+        }
+        batch = new SpriteBatch(instancedShader, geometryRegistry.InstancedSprite(), atlas);
+        asteroidLayer = new StaticLayer(shaderRegistry.Composite(), geometryRegistry.Sprite(), viewportWidth, viewportHeight);
+        
         srand(time(0));
         for( int i=0; i < asteroid_dim; i++) {
-            asteroid_objects.push_back(std::vector<Object*>());
             for (int j=0; j < asteroid_dim; j++) {
-                Texture* t;
                 int r = rand() % 4;
-                switch (r) {
-                    case 0:
-                        t = new Texture("/Users/Tongyu/Documents/AIT_Budapest/Graphics/Galaxy/Galaxy/asteroid.png");
-                        break;
-                    case 1:
-                        t = new Texture("/Users/Tongyu/Documents/AIT_Budapest/Graphics/Galaxy/Galaxy/asteroid1.png");
-                        break;
-                    case 2:
-                        t = new Texture("/Users/Tongyu/Documents/AIT_Budapest/Graphics/Galaxy/Galaxy/asteroid2.png");
-                        break;
-                    case 3:
-                        t = new Texture("/Users/Tongyu/Documents/AIT_Budapest/Graphics/Galaxy/Galaxy/asteroid3.png");
-                        break;
-                }
-                
                 float angle = rand() % 360;
                 
-                asteroid_materials.push_back(new TextureMaterial(textureShader, vec4(1, 0, 0), t));
-                asteroid_geometries.push_back(new TexturedQuad());
-                asteroid_meshes.push_back(new Mesh(asteroid_geometries[asteroid_dim*i + j], asteroid_materials[asteroid_dim*i + j]));
-                asteroid_objects[i].push_back(new EnemyObject(textureShader, asteroid_meshes[asteroid_dim*i + j], vec2(-0.75+(j*0.3), -0.4+(i*0.3)), vec2(0.2,0.2), angle));
+                material = new TextureMaterial(textureShader, vec4(1, 0, 0), atlas, asteroid_regions[r]);
+                mesh = new Mesh(geometryRegistry.Sprite(), material);
+                Add(new EnemyObject(textureShader, mesh, vec2(-0.75+(j*0.3), -0.4+(i*0.3)), vec2(0.2,0.2), angle, r), mesh, material);
             }
         }
         
     }
     ~Scene() {
-        for(int i = 0; i < materials.size(); i++) delete materials[i];
-        for(int i = 0; i < geometries.size(); i++) delete geometries[i];
-        for(int i = 0; i < meshes.size(); i++) delete meshes[i];
-        for(int i = 0; i < objects.size(); i++) delete objects[i];
-        
-        for(int i = 0; i < asteroid_materials.size(); i++) delete asteroid_materials[i];
-        for(int i = 0; i < asteroid_geometries.size(); i++) delete asteroid_geometries[i];
-        for(int i = 0; i < asteroid_meshes.size(); i++) delete asteroid_meshes[i];
-        for(int i = 0; i < asteroid_objects.size(); i++) {
-           for(int j = 0; j < asteroid_objects[i].size(); j++) {
-               delete asteroid_objects[i][j];
-           }
+        for(int i = 0; i < records.Capacity(); i++) {
+            if (records.Occupied(i)) Remove(records.HandleAt(i));
         }
         
-        if(textureShader) delete textureShader;
-        if(animatedShader) delete animatedShader;
+        if(batch) delete batch;
+        if(asteroidLayer) delete asteroidLayer;
+    }
+    
+    // takes ownership of the object, its mesh and its material
+    Handle Add(Object* object, Mesh* mesh, Material* material) {
+        return records.Insert(SceneEntity(object, mesh, material));
+    }
+    
+    Handle AddPooled(Object* object, PoolBase* pool, int slot) {
+        SceneEntity e;
+        e.object = object;
+        e.pool = pool;
+        e.poolSlot = slot;
+        return records.Insert(e);
+    }
+    
+    // frees the entity and everything it owns, or returns it to its pool;
+    // stale handles are ignored
+    void Remove(Handle h) {
+        SceneEntity* e = records.Get(h);
+        if (!e) return;
+        if (e->object->GetType() == ENTITY_ASTEROID) asteroidRemoved = true;
+        entities.Remove(e->object->GetEntity());
+        if (e->pool) {
+            e->pool->Release(e->poolSlot);
+        }
+        else {
+            delete e->object;
+            delete e->mesh;
+            delete e->material;
+        }
+        records.Remove(h);
     }
     
+    // null once the entity has been removed
+    Object* Get(Handle h) {
+        SceneEntity* e = records.Get(h);
+        return e ? e->object : 0;
+    }
+    
+    Object* GetAvatar() {return Get(avatar);}
+    
     void Draw()
     {
-        for(int i = 0; i < asteroid_objects.size(); i++) {
-            for(int j = 0; j < asteroid_objects[i].size(); j++) {
-                asteroid_objects[i][j]->GetShader()->Run();
-                asteroid_objects[i][j]->Draw();
-            }
+        bool viewChanged = viewBlock.Upload(camera.GetViewTransformationMatrix());
+        entities.UpdateTransforms(renderAlpha);
+        // a quake moves the camera, gravity and the dramatic exit move asteroids
+        bool asteroidsChanged = viewChanged || entities.MovedLastFrame(ENTITY_ASTEROID) || asteroidRemoved;
+        asteroidRemoved = false;
+        if (asteroidsChanged) asteroidLayer->Invalidate();
+        
+        drawList.Clear();
+        for(int i = 0; i < records.Capacity(); i++) {
+            if (!records.Occupied(i)) continue;
+            Object* o = records.At(i).object;
+            EntityType type = o->GetType();
+            if (batchSprites && type == ENTITY_ASTEROID) continue;
+            vec2 scaling = o->GetRenderScaling();
+            if (!camera.IsVisible(o->GetRenderLocation(), 0.5 * (fabsf(scaling.x) + fabsf(scaling.y)))) continue;
+            Texture* texture = o->GetMesh()->GetMaterial()->GetTexture();
+            drawList.Add(DrawList::Key(DrawList::Layer(type), o->GetShader()->GetProgram(), texture ? texture->GetId() : 0, drawList.Size()), o);
         }
+        drawList.Sort();
         
-        for(int i = 0; i < objects.size(); i++) {
-            objects[i]->GetShader()->Run();
-            objects[i]->Draw();
+        // everything shares the atlas, so the sorted list streams into the
+        // batch in order; the asteroids are layer 0, under everything in it
+        if (batchSprites) {
+            if (cacheAsteroids) DrawAsteroidLayer(asteroidsChanged);
+            else batch->AddEntities(entities, ENTITY_ASTEROID, &asteroid_regions[0]);
+            for(int i = 0; i < drawList.Size(); i++) {
+                Object* o = drawList[i].object;
+                batch->Add(entities.transform[o->GetEntity()], o->GetRegion());
+            }
+            batch->Flush();
+            return;
+        }
+        for(int i = 0; i < drawList.Size(); i++) {
+            Object* o = drawList[i].object;
+            o->GetShader()->Run();
+            o->Draw();
         }
     }
     
+    // the grid is redrawn into its layer once it has settled after a change;
+    // while it keeps changing a cached copy would be stale by the next frame,
+    // so it goes straight into the batch instead
+    void DrawAsteroidLayer(bool changed) {
+        if (entities.Count(ENTITY_ASTEROID) == 0) return;
+        asteroidLayer->Resize(viewportWidth, viewportHeight);
+        if (changed) {
+            batch->AddEntities(entities, ENTITY_ASTEROID, &asteroid_regions[0]);
+            return;
+        }
+        if (!asteroidLayer->Valid()) {
+            asteroidLayer->BeginRebuild();
+            batch->AddEntities(entities, ENTITY_ASTEROID, &asteroid_regions[0]);
+            batch->Flush();
+            asteroidLayer->EndRebuild();
+        }
+        asteroidLayer->Composite();
+    }
+    
+    int AsteroidLayerRebuilds() {return asteroidLayer ? asteroidLayer->Rebuilds() : 0;}
+    
     void SetTime(float time) {
-        for(int i = 0; i < objects.size(); i++) objects[i]->SetTime(time);
+        for(int i = 0; i < records.Capacity(); i++) {
+            if (records.Occupied(i)) records.At(i).object->SetTime(time);
+        }
+    }
+    
+    // snapshot every entity so Draw can interpolate towards the next tick
+    void SaveState() {
+        entities.SaveState();
     }
     
+    // records or entities per job; big enough that queueing is noise
+    static const int moveGrain = 4096;
+    
+    // every phase is a parallel pass in which an object writes only its own
+    // entity, and nothing is created or removed until the passes are done; the
+    // removals are then applied in record order, as a serial loop would
     void Move(float time, float time_lapsed) {
-        for(int i = 0; i < objects.size(); i++) {
-            objects[i]->Move(time, time_lapsed);
-            objects[i]->Control(objects, i, asteroid_objects);
-            if(objects[i]->ShouldBeDeleted()) {
-                if(objects[i]->IsEnemy()) {Explode(objects[i]->GetLocation(), time, time_lapsed);}
-                materials.erase(materials.begin()+i);
-                geometries.erase(geometries.begin()+i);
-                meshes.erase(meshes.begin()+i);
-                objects.erase(objects.begin()+i);
+        int n = records.Capacity();
+        
+        // the seeker steers by the avatar, so the avatar moves first
+        Object* avatarObject = GetAvatar();
+        if (avatarObject) avatarObject->Move(time, time_lapsed);
+        jobs.ParallelFor(n, moveGrain, [&](int chunk, int begin, int end) {
+            for(int i = begin; i < end; i++) {
+                if (!records.Occupied(i)) continue;
+                Object* o = records.At(i).object;
+                if (o != avatarObject) o->Move(time, time_lapsed);
             }
-            if(objects[i]->DoneExploding(time_lapsed)) {
-                materials.erase(materials.begin()+i);
-                geometries.erase(geometries.begin()+i);
-                meshes.erase(meshes.begin()+i);
-                objects.erase(objects.begin()+i);
+        });
+        
+        bool pull = gravity.Holes() > 0;
+        jobs.ParallelFor(entities.Size(), moveGrain, [&](int chunk, int begin, int end) {
+            if (pull && gravityField.Valid()) entities.ApplyGravity(ENTITY_ASTEROID, gravityField, time, begin, end);
+            else if (pull) entities.ApplyGravity(ENTITY_ASTEROID, gravity, time, begin, end);
+            entities.DramaticExit(begin, end);
+        });
+        
+        // projectiles only test the targets in the grid cells they overlap
+        broadphase.Build(entities);
+        int chunks = (n + moveGrain - 1) / moveGrain;
+        if ((int)chunkHits.size() < chunks) chunkHits.resize(chunks);
+        jobs.ParallelFor(n, moveGrain, [&](int chunk, int begin, int end) {
+            EntityQuery query(broadphase, chunkHits[chunk]);
+            for(int i = begin; i < end; i++) {
+                if (records.Occupied(i)) records.At(i).object->Control(query);
             }
+        });
+        for(int c = 0; c < chunks; c++) {
+            for(size_t i = 0; i < chunkHits[c].size(); i++) entities.flags[chunkHits[c][i]] |= ENTITY_HIT;
+            chunkHits[c].clear();
         }
-        for(int i = 0; i < asteroid_objects.size(); i++) {
-            for(int j = 0; j < asteroid_objects[i].size(); j++) {
-                asteroid_objects[i][j]->Move(time, time_lapsed);
-                asteroid_objects[i][j]->DramaticExit();
-                if(asteroid_objects[i][j]->ShouldBeDeleted()) {
-                    if(asteroid_objects[i][j]->IsEnemy()) {Explode(asteroid_objects[i][j]->GetLocation(), time, time_lapsed);}
-                    asteroid_objects[i].erase(asteroid_objects[i].begin()+j);
+        
+        if ((int)chunkRemovals.size() < chunks) chunkRemovals.resize(chunks);
+        jobs.ParallelFor(n, moveGrain, [&](int chunk, int begin, int end) {
+            std::vector<Removal>& removals = chunkRemovals[chunk];
+            removals.clear();
+            for(int i = begin; i < end; i++) {
+                if (!records.Occupied(i)) continue;
+                Object* o = records.At(i).object;
+                if(o->ShouldBeDeleted()) {
+                    Removal r = {records.HandleAt(i), o->IsEnemy(), o->GetLocation()};
+                    removals.push_back(r);
                 }
+                else if(o->DoneExploding(time_lapsed)) {
+                    Removal r = {records.HandleAt(i), false, vec2()};
+                    removals.push_back(r);
+                }
+            }
+        });
+        
+        // explosions first, in record order, then the removals
+        for(int c = 0; c < chunks; c++) {
+            for(size_t i = 0; i < chunkRemovals[c].size(); i++) {
+                if (chunkRemovals[c][i].explode) Explode(chunkRemovals[c][i].position, time, time_lapsed);
             }
         }
+        for(int c = 0; c < chunks; c++) {
+            for(size_t i = 0; i < chunkRemovals[c].size(); i++) Remove(chunkRemovals[c][i].handle);
+            chunkRemovals[c].clear();
+        }
     }
     
+    // the spawners drop the effect when its pool is exhausted
     void Explode(vec2 position, float time, float time_lapsed) {
-        // explosion thing here
-        Texture* t = new Texture("/Users/Tongyu/Documents/AIT_Budapest/Graphics/Galaxy/Galaxy/boom.png");
-        materials.push_back(new AnimatedTexturedMaterial(animatedShader, vec4(1, 0, 0), t, 6));
-        geometries.push_back(new TexturedQuad());
-        meshes.push_back(new Mesh(geometries[objects.size()], materials[objects.size()]));
-        objects.push_back(new ExplodingObject(animatedShader, meshes[objects.size()], position, vec2(0.4,0.4), 0, time, time_lapsed));
+        int slot;
+        Object* o = explosions.Spawn(slot, position, vec2(0.4,0.4), 0.0f, time, time_lapsed);
+        if (o) AddPooled(o, &explosions, slot);
     }
     
-    void AsteroidDisappear() {
-        for (int i = 0; i < asteroid_objects.size(); i++) {
-            for (int j = 0; j < asteroid_objects[i].size(); j++) {
-                if (rand() % 1000 < 1) {
-                    asteroid_objects[i][j]->SetDramatic();
-                }
-            }
-        }
+    void SpawnProjectile(vec2 position) {
+        int slot;
+        Object* o = projectiles.Spawn(slot, position, vec2(0.4,0.4), 0.0f);
+        if (o) AddPooled(o, &projectiles, slot);
     }
     
-    void placeBlackHole() {
-        int length = objects.size();
-        
-        Texture* t = new Texture("/Users/Tongyu/Documents/AIT_Budapest/Graphics/Galaxy/Galaxy/blackhole.png");
-        materials.push_back(new TextureMaterial(textureShader, vec4(1, 0, 0), t));
-        geometries.push_back(new TexturedQuad());
-        meshes.push_back(new Mesh(geometries[length], materials[length]));
-        objects.push_back(new BlackHoleObject(textureShader, meshes[length], blackHolePos, vec2(0.5,0.5), 0));
-        
-        blackHolePlaced = true;
+    void SpawnFireball(vec2 position, float orientation, vec2 norm_path) {
+        int slot;
+        Object* o = fireballs.Spawn(slot, position, vec2(0.4,0.4), orientation, norm_path);
+        if (o) AddPooled(o, &fireballs, slot);
     }
     
-    void removeBlackHole() {
-        for (int i = 0; i < objects.size(); i++) {
-            if (objects[i]->IsBlackHole()) {
-                materials.erase(materials.begin()+i);
-                geometries.erase(geometries.begin()+i);
-                meshes.erase(meshes.begin()+i);
-                objects.erase(objects.begin()+i);
-                blackHolePlaced = false;
-            }
+    void PrintGravityFieldStats() {
+        if (gravityField.Builds() == 0) {
+            printf("gravity field never built\n");
+            return;
         }
+        printf("gravity field %d x %d built %d times, %.2f ms per build, error against the exact pull: mean %.3f%%, max %.3f%%\n",
+               gravityField.Cells(), gravityField.Cells(), gravityField.Builds(), gravityField.BuildSeconds() * 1000 / gravityField.Builds(),
+               gravityField.MeanError() * 100, gravityField.MaxError() * 100);
     }
     
-    std::vector<Material*> GetMaterials() {
-        return materials;
-    }
-    
-    void AddMaterial(Material* m) {
-        materials.push_back(m);
-    }
-    
-    std::vector<Geometry*> GetGeometries() {
-        return geometries;
-    }
-    
-    void AddGeometry(Geometry* g) {
-        geometries.push_back(g);
+    void PrintPoolStats() {
+        projectiles.PrintStats();
+        fireballs.PrintStats();
+        explosions.PrintStats();
     }
     
-    std::vector<Mesh*> GetMeshes() {
-        return meshes;
+    void AsteroidDisappear() {
+        for (int i = 0; i < records.Capacity(); i++) {
+            if (!records.Occupied(i) || records.At(i).object->GetType() != ENTITY_ASTEROID) continue;
+            if (rand() % 1000 < 1) {
+                records.At(i).object->SetDramatic();
+            }
+        }
     }
     
-    void AddMesh(Mesh* m) {
-        meshes.push_back(m);
+    // the first hole sits where the single one always did, the others spread
+    // over the asteroid grid on a sunflower spiral
+    vec2 BlackHolePosition(int i) {
+        if (i == 0) return blackHolePos;
+        float extent = 0.3 * (asteroid_dim - 1);
+        vec2 center = vec2(-0.75 + extent/2, -0.4 + extent/2);
+        float radius = (extent/2 + 0.3) * sqrtf((float)i / blackHoleCount);
+        float angle = i * 2.39996323f; // golden angle
+        return vec2(center.x + radius*cosf(angle), center.y + radius*sinf(angle));
     }
     
-    std::vector<Object*> GetObjects() {
-        return objects;
+    void placeBlackHole() {
+        gravity.Clear();
+        for (int i = 0; i < blackHoleCount; i++) {
+            vec2 position = BlackHolePosition(i);
+            Material* material = new TextureMaterial(textureShader, vec4(1, 0, 0), spriteAtlas.GetTexture(), spriteAtlas.Region("blackhole.png"));
+            Mesh* mesh = new Mesh(geometryRegistry.Sprite(), material);
+            blackHoles.push_back(Add(new BlackHoleObject(textureShader, mesh, position, vec2(0.5,0.5), 0), mesh, material));
+            gravity.AddHole(position);
+        }
+        gravity.Build();
+        
+        // over the asteroid lattice with room to fall past it
+        if (gravityFieldCells > 0) {
+            float extent = 0.3 * (asteroid_dim - 1);
+            float margin = 1;
+            gravityField.Build(gravity, -0.75 - margin, -0.4 - margin, -0.75 + extent + margin, -0.4 + extent + margin, gravityFieldCells);
+        }
+        
+        blackHolePlaced = true;
     }
     
-    void AddObject(Object* o) {
-        objects.push_back(o);
+    void removeBlackHole() {
+        for (size_t i = 0; i < blackHoles.size(); i++) Remove(blackHoles[i]);
+        blackHoles.clear();
+        gravity.Clear();
+        gravityField.Clear();
+        blackHolePlaced = false;
     }
     
 };
 
 Scene *gScene = 0;
-TexturedShader* projectileShader = 0;
-TexturedShader* fireballShader = 0;
 float lastProjectileTime = 0;
 bool mouseDown = false;
 float cx, cy;
 
 void shootProjectile() {
     if (lastProjectileTime >= 0) {
-        projectileShader = new TexturedShader();
-        
-        std::vector<Object*> objects = gScene->GetObjects();
-        int length = objects.size();
-        
-        Texture* t = new Texture("/Users/Tongyu/Documents/AIT_Budapest/Graphics/Galaxy/Galaxy/bullet.png");
-        gScene->AddMaterial(new TextureMaterial(projectileShader, vec4(1, 0, 0), t));
-        gScene->AddGeometry(new TexturedQuad());
-        
-        std::vector<Material*> materials = gScene->GetMaterials();
-        std::vector<Geometry*> geometries = gScene->GetGeometries();
-        gScene->AddMesh(new Mesh(geometries[length], materials[length]));
-        
-        std::vector<Mesh*> meshes = gScene->GetMeshes();
-        vec2 projectile_location = objects[0]->GetLocation() + vec2(0, 0.1);
-        gScene->AddObject(new ProjectileObject(projectileShader, meshes[length], projectile_location, vec2(0.4,0.4), 0));
+        vec2 projectile_location = gScene->GetAvatar()->GetLocation() + vec2(0, 0.1);
+        gScene->SpawnProjectile(projectile_location);
         
         lastProjectileTime = -1; //cooldown time
     }
 }
 
 void shootFireball(float x, float y) {
-    fireballShader = new TexturedShader();
-    
-    std::vector<Object*> objects = gScene->GetObjects();
-    int length = objects.size();
-    
-    Texture* t = new Texture("/Users/Tongyu/Documents/AIT_Budapest/Graphics/Galaxy/Galaxy/fireball.png");
-    gScene->AddMaterial(new TextureMaterial(fireballShader, vec4(1, 0, 0), t));
-    gScene->AddGeometry(new TexturedQuad());
-    
-    std::vector<Material*> materials = gScene->GetMaterials();
-    std::vector<Geometry*> geometries = gScene->GetGeometries();
-    gScene->AddMesh(new Mesh(geometries[length], materials[length]));
-    
-    std::vector<Mesh*> meshes = gScene->GetMeshes();
-    vec2 path = vec2(x,y) - objects[0]->GetLocation();
+    vec2 avatar_location = gScene->GetAvatar()->GetLocation();
+    vec2 path = vec2(x,y) - avatar_location;
     vec2 norm_path = vec2(path.x/path.length(), path.y/path.length());
-    vec2 projectile_location = objects[0]->GetLocation() + norm_path*0.1;
+    vec2 projectile_location = avatar_location + norm_path*0.1;
     
     float rotate_angle = 0;
     // dot products
@@ -1603,7 +3646,7 @@ void shootFireball(float x, float y) {
         rotate_angle = -acos(norm_path.y)*(180/M_PI);
     }
     
-    gScene->AddObject(new FireballObject(fireballShader, meshes[length], projectile_location, vec2(0.4,0.4), 60+rotate_angle, norm_path));
+    gScene->SpawnFireball(projectile_location, 60+rotate_angle, norm_path);
 }
 
 // initialization, create an OpenGL context
@@ -1611,6 +3654,14 @@ void onInitialization()
 {
     glViewport(0, 0, windowWidth, windowHeight);
     
+    jobs.Start(jobThreads);
+    viewBlock.Initialize();
+    shaderRegistry.Initialize();
+    geometryRegistry.Initialize();
+    const char* sprites[] = {"spaceship.png", "orb.png", "rocket.png", "fish.png",
+        "asteroid.png", "asteroid1.png", "asteroid2.png", "asteroid3.png",
+        "bullet.png", "fireball.png", "boom.png", "blackhole.png"};
+    spriteAtlas.Build(assetPath, sprites, sizeof(sprites) / sizeof(sprites[0]));
     gScene = new Scene();
     gScene->Initialize();
 }
@@ -1618,11 +3669,22 @@ void onInitialization()
 void onExit()
 {
     delete gScene;
-    delete projectileShader;
-    delete fireballShader;
+    spriteAtlas.Destroy();
+    geometryRegistry.Destroy();
+    shaderRegistry.Destroy();
+    viewBlock.Destroy();
+    jobs.Stop();
     printf("exit");
 }
 
+// window has been resized
+void onReshape(int width, int height)
+{
+    viewportWidth = width;
+    viewportHeight = height;
+    glViewport(0, 0, width, height);
+}
+
 // window has become invalid: redraw
 void onDisplay()
 {
@@ -1630,6 +3692,7 @@ void onDisplay()
     glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT); // clear the screen
     
     gScene->Draw();
+    renderState.EndFrame();
     
     glutSwapBuffers(); // exchange the two buffers
 }
@@ -1676,6 +3739,45 @@ void onKeyboard(unsigned char key, int i, int j) {
     //showTriangle = !showTriangle;
 }
 
+// advances the game by one tick of dt seconds; t is the simulated time
+void StepSimulation(double dt, double t) {
+    lastProjectileTime = lastProjectileTime + dt;
+    camera.Move(dt, t);
+    
+    gScene->Move(dt, t*2);
+    
+    if (mouseDown && !keyboardState['b']) {
+        shootFireball(cx, cy);
+    }
+    if (keyboardState['q']) {
+        gScene->AsteroidDisappear();
+    }
+    
+}
+
+// runs the fixed ticks covered by frameDt seconds of real time and sets up
+// interpolation for the frame; returns the number of ticks run
+int AdvanceFrame(double frameDt) {
+    int steps = timestep.Advance(frameDt);
+    for (int i = 0; i < steps; i++) {
+        gScene->SaveState();
+        StepSimulation(timestep.Step(), simulationTime);
+        simulationTime += timestep.Step();
+    }
+    renderAlpha = timestep.Alpha();
+    gScene->SetTime((simulationTime + renderAlpha * timestep.Step()) * 2);
+    
+    shaderRegistry.EndFrame();
+    if (shaderRegistry.CompilesLastFrame() > 0) {
+        printf("%d shader compiles this frame\n", shaderRegistry.CompilesLastFrame());
+    }
+    geometryRegistry.EndFrame();
+    if (geometryRegistry.VertexArraysLastFrame() > 0) {
+        printf("%d vertex arrays created this frame\n", geometryRegistry.VertexArraysLastFrame());
+    }
+    return steps;
+}
+
 void onIdle( ) {
     // time elapsed since program started, in seconds
     double t = glutGet(GLUT_ELAPSED_TIME) * 0.001;
@@ -1685,23 +3787,527 @@ void onIdle( ) {
     double dt = abs(t - lastTime);
     // store time
     lastTime = t;
-    lastProjectileTime = lastProjectileTime + dt;
-    camera.Move(dt, t);
     
-    gScene->SetTime(t*2);
-    gScene->Move(dt, t*2);
+    AdvanceFrame(dt);
     
-    if (mouseDown && !keyboardState['b']) {
-        shootFireball(cx, cy);
+    glutPostRedisplay();
+}
+
+#if defined(GALAXY_HEADLESS)
+
+// heap allocations made so far, to check that steady-state ticks allocate
+// nothing; job threads allocate too, so the count is atomic
+std::atomic<size_t> heapAllocations(0);
+
+void* operator new(size_t size) {
+    heapAllocations.fetch_add(1, std::memory_order_relaxed);
+    void* p = malloc(size);
+    if (!p) throw std::bad_alloc();
+    return p;
+}
+
+void operator delete(void* p) noexcept { free(p); }
+void operator delete(void* p, size_t) noexcept { free(p); }
+
+// a key (or the mouse button) held from tick start until tick end
+struct ScriptedInput {
+    int start, end;
+    unsigned char key;
+    bool mouse;
+    float x, y;
+};
+
+// default session: fly around, shoot, quake, flamethrower, black hole on and off
+std::vector<ScriptedInput> DefaultScript() {
+    ScriptedInput script[] = {
+        {0, 90, 'd', false, 0, 0},
+        {90, 180, 'a', false, 0, 0},
+        {180, 240, 'w', false, 0, 0},
+        {240, 300, 's', false, 0, 0},
+        {30, 31, ' ', false, 0, 0},
+        {200, 201, ' ', false, 0, 0},
+        {320, 420, 'q', false, 0, 0},
+        {450, 700, 0, true, 0.3, 0.8},
+        {750, 751, 'b', false, 0, 0},
+        {1100, 1101, 'b', false, 0, 0},
+    };
+    return std::vector<ScriptedInput>(script, script + sizeof(script) / sizeof(script[0]));
+}
+
+// script file: one "start end key" line per input, key is a character,
+// "space", or "mouse x y" for a held mouse button at world coordinates x, y
+bool LoadScript(const char* path, std::vector<ScriptedInput>& script) {
+    FILE* file = fopen(path, "r");
+    if (!file) return false;
+    char line[256];
+    while (fgets(line, sizeof(line), file)) {
+        ScriptedInput input = {0, 0, 0, false, 0, 0};
+        char key[32];
+        if (line[0] == '#' || sscanf(line, "%d %d %31s", &input.start, &input.end, key) != 3) continue;
+        if (strcmp(key, "mouse") == 0) {
+            input.mouse = true;
+            sscanf(line, "%*d %*d %*s %f %f", &input.x, &input.y);
+        }
+        else if (strcmp(key, "space") == 0) input.key = ' ';
+        else input.key = key[0];
+        script.push_back(input);
     }
-    if (keyboardState['q']) {
-        gScene->AsteroidDisappear();
+    fclose(file);
+    return true;
+}
+
+// applies every press and release scheduled for ticks first..last
+void ApplyScript(const std::vector<ScriptedInput>& script, int first, int last) {
+    for (size_t i = 0; i < script.size(); i++) {
+        const ScriptedInput& input = script[i];
+        bool press = input.start >= first && input.start <= last;
+        bool release = input.end >= first && input.end <= last;
+        if (input.mouse) {
+            if (press) {
+                cx = input.x;
+                cy = input.y;
+                mouseDown = true;
+            }
+            if (release) mouseDown = false;
+        }
+        else {
+            if (press) onKeyboard(input.key, 0, 0);
+            if (release) onKeyboardUp(input.key, 0, 0);
+        }
+    }
+}
+
+// the layout entities had before EntityStore: every body its own heap
+// object, reached through a pointer and a virtual call
+class LegacyBody {
+    vec2 position, scaling;
+    float orientation;
+    float velocity = 0.0001;
+    vec2 previousPosition, previousScaling;
+    float previousOrientation;
+    
+public:
+    LegacyBody(vec2 position, vec2 scaling, float orientation) :
+    position(position), scaling(scaling), orientation(orientation) {
+        SaveState();
     }
     
+    virtual ~LegacyBody() {}
     
-    glutPostRedisplay();
+    virtual void Move(float dt, vec2 center) {
+        vec2 path = center - position;
+        
+        float m1 = 40; //blackhole mass
+        float m2 = 0.5; //asteroid mass
+        float r = path.length()*100;
+        float force = 9.81*((m1*m2)/r*r); //law of gravitation
+        
+        float acceleration = force*(1/m2);
+        velocity = velocity + acceleration * dt; //new velocity
+        
+        vec2 norm_path = vec2(path.x/path.length(), path.y/path.length());
+        position = position + norm_path*(velocity * (dt/1000));
+    }
+    
+    virtual void SaveState() {
+        previousPosition = position;
+        previousScaling = scaling;
+        previousOrientation = orientation;
+    }
+    
+    virtual vec2 GetRenderLocation(float alpha) {return previousPosition + (position - previousPosition) * alpha;}
+    virtual vec2 GetRenderScaling(float alpha) {return previousScaling + (scaling - previousScaling) * alpha;}
+    virtual float GetRenderOrientation(float alpha) {
+        float delta = fmodf(orientation - previousOrientation + 540, 360) - 180;
+        return previousOrientation + delta * alpha;
+    }
+};
+
+// times a tick's worth of entity work (snapshot, gravity, interpolated
+// instance data) for the same bodies in both layouts
+void BenchmarkEntityLayouts(int bodies, int iterations) {
+    std::vector<LegacyBody*> legacy;
+    std::vector<void*> padding; // spread the bodies over the heap like a running game does
+    EntityStore store;
+    srand(1);
+    for (int i = 0; i < bodies; i++) {
+        vec2 position = vec2(rand() % 1000 / 250.0 - 2, rand() % 1000 / 250.0 - 2);
+        float orientation = rand() % 360;
+        legacy.push_back(new LegacyBody(position, vec2(0.2, 0.2), orientation));
+        padding.push_back(malloc(rand() % 256 + 16));
+        store.Add(0, ENTITY_ASTEROID, position, vec2(0.2, 0.2), orientation);
+        store.velocity[i] = 0.0001;
+    }
+    std::vector<float> instances;
+    instances.reserve(bodies * InstancedTexturedQuad::instanceFloats);
+    vec2 center = vec2(0, 0.4);
+    GravitySolver gravity;
+    gravity.AddHole(center);
+    gravity.Build();
+    float dt = 1.0 / 60;
+    float alpha = 0.5;
+    AtlasRegion regions[1] = {{0, 0, 1, 1}};
+    
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (int k = 0; k < iterations; k++) {
+        for (size_t i = 0; i < legacy.size(); i++) legacy[i]->SaveState();
+        for (size_t i = 0; i < legacy.size(); i++) legacy[i]->Move(dt, center);
+        instances.clear();
+        for (size_t i = 0; i < legacy.size(); i++) {
+            Affine2D a = MakeAffine(legacy[i]->GetRenderLocation(alpha), legacy[i]->GetRenderScaling(alpha), legacy[i]->GetRenderOrientation(alpha));
+            instances.insert(instances.end(), a.Floats(), a.Floats() + 6);
+            instances.insert(instances.end(), &regions[0].u, &regions[0].u + 4);
+        }
+    }
+    double legacySeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    float legacyCheck = instances[4];
+    
+    start = std::chrono::steady_clock::now();
+    for (int k = 0; k < iterations; k++) {
+        store.SaveState();
+        store.ApplyGravity(ENTITY_ASTEROID, gravity, dt);
+        store.UpdateTransforms(alpha);
+        instances.clear();
+        store.BuildInstances(ENTITY_ASTEROID, regions, instances);
+    }
+    double storeSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    
+    double updates = (double)bodies * iterations;
+    printf("%d bodies, %d ticks of snapshot, gravity and instance building\n", bodies, iterations);
+    printf("pointers + virtual calls: %.2f ns per body\n", legacySeconds * 1e9 / updates);
+    printf("structure of arrays:      %.2f ns per body (%.2fx)\n", storeSeconds * 1e9 / updates, legacySeconds / storeSeconds);
+    printf("first body x: %f / %f\n", legacyCheck, instances[4]);
+    
+    for (size_t i = 0; i < legacy.size(); i++) delete legacy[i];
+    for (size_t i = 0; i < padding.size(); i++) free(padding[i]);
 }
 
+// times the per-sprite transform: the S * R * T * V mat4 product the
+// renderer used to build for every sprite against each affine kernel
+void BenchmarkTransforms(int sprites, int iterations) {
+    SpriteArrays in;
+    in.Reserve(sprites);
+    srand(1);
+    for (int i = 0; i < sprites; i++) {
+        vec2 position = vec2(rand() % 1000 / 250.0 - 2, rand() % 1000 / 250.0 - 2);
+        float orientation = rand() % 72000 / 7.0 - 5000; // spinning asteroids wind far past 360
+        in.Add(position, vec2(0.2, 0.2), orientation);
+    }
+    const int stride = InstancedTexturedQuad::instanceFloats;
+    std::vector<float> reference(sprites * stride), out(sprites * stride);
+    std::vector<mat4> matrices(sprites);
+    mat4 V = camera.GetViewTransformationMatrix();
+    
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (int k = 0; k < iterations; k++) {
+        for (int i = 0; i < sprites; i++) {
+            mat4 S = {in.scalingX[i],0,0,0, 0,in.scalingY[i],0,0, 0,0,1,0, 0,0,0,1};
+            float radians = in.orientation[i]/180*M_PI;
+            mat4 R = {cos(radians),sin(radians),0,0, -sin(radians),cos(radians),0,0, 0,0,1,0, 0,0,0,1};
+            mat4 T = {1,0,0,0, 0,1,0,0, 0,0,1,0, in.x[i],in.y[i],0,1};
+            matrices[i] = S * R * T * V;
+        }
+    }
+    double matSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    double updates = (double)sprites * iterations;
+    printf("%d sprites, %d frames of model transforms\n", sprites, iterations);
+    printf("mat4 S * R * T * V: %6.2f ns per sprite\n", matSeconds * 1e9 / updates);
+    
+    AffineKernelScalar(&in.x[0], &in.y[0], &in.scalingX[0], &in.scalingY[0], &in.orientation[0], sprites, &reference[0], stride);
+    AffineKernelEntry kernels[4];
+    int count = AvailableAffineKernels(kernels);
+    for (int j = 0; j < count; j++) {
+        start = std::chrono::steady_clock::now();
+        for (int k = 0; k < iterations; k++) {
+            kernels[j].kernel(&in.x[0], &in.y[0], &in.scalingX[0], &in.scalingY[0], &in.orientation[0], sprites, &out[0], stride);
+        }
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        
+        float error = 0;
+        for (int i = 0; i < sprites; i++) {
+            for (int c = 0; c < 6; c++) error = std::max(error, fabsf(out[i * stride + c] - reference[i * stride + c]));
+        }
+        printf("affine %-12s %6.2f ns per sprite (%.2fx), max error %g%s\n", kernels[j].name, seconds * 1e9 / updates,
+               matSeconds / seconds, error, kernels[j].kernel == affineKernel.kernel ? ", in use" : "");
+    }
+}
+
+// times the exact sum over every hole against the Barnes-Hut tree at a few
+// opening angles, and how far the tree's pull strays from the exact one
+void BenchmarkGravity(int bodies, int holes, int iterations) {
+    std::vector<float> x(bodies), y(bodies);
+    std::vector<float> exactX(bodies), exactY(bodies);
+    GravitySolver gravity(0);
+    srand(1);
+    for (int i = 0; i < bodies; i++) {
+        x[i] = rand() % 10000 / 2500.0 - 2;
+        y[i] = rand() % 10000 / 2500.0 - 2;
+    }
+    for (int h = 0; h < holes; h++) gravity.AddHole(vec2(rand() % 1000 / 250.0 - 2, rand() % 1000 / 250.0 - 2));
+    gravity.Build();
+    printf("%d bodies, %d holes, %d rounds of gravity\n", bodies, holes, iterations);
+    
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (int k = 0; k < iterations; k++) {
+        for (int i = 0; i < bodies; i++) gravity.Acceleration(x[i], y[i], exactX[i], exactY[i]);
+    }
+    double exactSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    double updates = (double)bodies * iterations;
+    printf("exact:            %8.2f ns per body\n", exactSeconds * 1e9 / updates);
+    
+    float thetas[3] = {0.25, 0.5, 1.0};
+    for (int j = 0; j < 3; j++) {
+        gravity.SetTheta(thetas[j]);
+        float ax = 0, ay = 0;
+        start = std::chrono::steady_clock::now();
+        for (int k = 0; k < iterations; k++) {
+            for (int i = 0; i < bodies; i++) gravity.Acceleration(x[i], y[i], ax, ay);
+        }
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        
+        // error relative to the exact pull, which stays well away from zero
+        // only where the holes do not cancel out, so take it against the mean
+        double error = 0, maxError = 0, magnitude = 0;
+        for (int i = 0; i < bodies; i++) {
+            gravity.Acceleration(x[i], y[i], ax, ay);
+            double e = hypot(ax - exactX[i], ay - exactY[i]);
+            error += e;
+            maxError = std::max(maxError, e);
+            magnitude += hypot(exactX[i], exactY[i]);
+        }
+        printf("theta %.2f:       %8.2f ns per body (%.2fx), %d nodes, mean error %.4f%%, max %.4f%%%s\n", thetas[j], seconds * 1e9 / updates,
+               exactSeconds / seconds, gravity.Nodes(), error / magnitude * 100, maxError / (magnitude / bodies) * 100, thetas[j] == gravityTheta ? ", in use" : "");
+    }
+    
+    gravity.SetTheta(gravityTheta);
+    int resolutions[3] = {64, 256, 1024};
+    for (int j = 0; j < 3; j++) {
+        GravityField field;
+        field.Build(gravity, -2, -2, 2, 2, resolutions[j]);
+        float ax = 0, ay = 0;
+        start = std::chrono::steady_clock::now();
+        for (int k = 0; k < iterations; k++) {
+            for (int i = 0; i < bodies; i++) field.Acceleration(x[i], y[i], ax, ay);
+        }
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        
+        double error = 0, maxError = 0, magnitude = 0;
+        for (int i = 0; i < bodies; i++) {
+            field.Acceleration(x[i], y[i], ax, ay);
+            double e = hypot(ax - exactX[i], ay - exactY[i]);
+            error += e;
+            maxError = std::max(maxError, e);
+            magnitude += hypot(exactX[i], exactY[i]);
+        }
+        printf("field %4d x %-4d %8.2f ns per body (%.2fx), %.1f ms to build, mean error %.4f%%, max %.4f%%\n", resolutions[j], resolutions[j],
+               seconds * 1e9 / updates, exactSeconds / seconds, field.BuildSeconds() * 1000, error / magnitude * 100, maxError / (magnitude / bodies) * 100);
+    }
+}
+
+// a random float in [lo, hi)
+float RandomIn(float lo, float hi) {
+    return lo + (hi - lo) * (rand() / ((float)RAND_MAX + 1));
+}
+
+// differential test of every narrowphase kernel against SweptHit: random
+// shots and targets, plus still targets, targets flying alongside the shot
+// and targets right on the hit radius, in blocks of every length. A kernel
+// may only disagree where the closest approach rounds across the radius;
+// returns the number of other disagreements
+int CheckNarrowphase(int rounds) {
+    const int maxTargets = 300;
+    std::vector<float> fromX(maxTargets), fromY(maxTargets), toX(maxTargets), toY(maxTargets);
+    uint32_t masks[(maxTargets + 31) / 32];
+    float radius2 = projectileHitRadius * projectileHitRadius;
+    NarrowphaseKernelEntry kernels[4];
+    int count = AvailableNarrowphaseKernels(kernels);
+    int failures[4] = {}, ties[4] = {};
+    long tests = 0;
+    srand(1);
+    for (int k = 0; k < rounds; k++) {
+        int n = rand() % (maxTargets + 1);
+        float px0 = RandomIn(-2, 2), py0 = RandomIn(-2, 2);
+        float px1 = px0 + RandomIn(-1, 1), py1 = py0 + RandomIn(-1, 1);
+        if (rand() % 8 == 0) px1 = px0, py1 = py0;
+        for (int i = 0; i < n; i++) {
+            fromX[i] = RandomIn(-2, 2);
+            fromY[i] = RandomIn(-2, 2);
+            toX[i] = fromX[i] + RandomIn(-0.5, 0.5);
+            toY[i] = fromY[i] + RandomIn(-0.5, 0.5);
+            switch (rand() % 4) {
+                case 1: // still
+                    toX[i] = fromX[i];
+                    toY[i] = fromY[i];
+                    break;
+                case 2: // no relative motion
+                    fromX[i] = px0 + RandomIn(-0.3, 0.3);
+                    fromY[i] = py0 + RandomIn(-0.3, 0.3);
+                    toX[i] = fromX[i] + (px1 - px0);
+                    toY[i] = fromY[i] + (py1 - py0);
+                    break;
+                case 3: { // still, on the radius around where the shot ends
+                    float angle = RandomIn(0, 2 * M_PI);
+                    toX[i] = fromX[i] = px1 + cosf(angle) * projectileHitRadius;
+                    toY[i] = fromY[i] = py1 + sinf(angle) * projectileHitRadius;
+                    break;
+                }
+            }
+        }
+        tests += n;
+        for (int j = 0; j < count; j++) {
+            kernels[j].kernel(px0, py0, px1, py1, &fromX[0], &fromY[0], &toX[0], &toY[0], n, radius2, masks);
+            for (int i = 0; i < n; i++) {
+                bool hit = (masks[i / 32] >> (i % 32)) & 1;
+                if (hit == SweptHit(px0, py0, px1, py1, fromX[i], fromY[i], toX[i], toY[i], radius2)) continue;
+                float d2 = SweptDistance2(px0, py0, px1, py1, fromX[i], fromY[i], toX[i], toY[i]);
+                if (fabsf(d2 - radius2) <= 1e-5f * radius2) ties[j]++;
+                else failures[j]++;
+            }
+        }
+    }
+    
+    int total = 0;
+    printf("%ld swept tests in %d blocks\n", tests, rounds);
+    for (int j = 0; j < count; j++) {
+        printf("narrowphase %-8s %s: %d wrong, %d on the radius within rounding%s\n", kernels[j].name, failures[j] ? "FAILED" : "ok",
+               failures[j], ties[j], kernels[j].kernel == narrowphaseKernel.kernel ? ", in use" : "");
+        total += failures[j];
+    }
+    return total;
+}
+
+// times each narrowphase kernel sweeping shots against one long block of
+// targets, as in a crowded broadphase cell
+void BenchmarkNarrowphase(int targets, int shots, int iterations) {
+    std::vector<float> fromX(targets), fromY(targets), toX(targets), toY(targets);
+    std::vector<float> shotX(shots * 2), shotY(shots * 2);
+    std::vector<uint32_t> masks((targets + 31) / 32);
+    float radius2 = projectileHitRadius * projectileHitRadius;
+    srand(1);
+    for (int i = 0; i < targets; i++) {
+        fromX[i] = RandomIn(-2, 2);
+        fromY[i] = RandomIn(-2, 2);
+        toX[i] = fromX[i] + RandomIn(-0.01, 0.01);
+        toY[i] = fromY[i] + RandomIn(-0.01, 0.01);
+    }
+    for (int k = 0; k < shots; k++) {
+        shotX[k * 2] = RandomIn(-2, 2);
+        shotY[k * 2] = RandomIn(-2, 2);
+        shotX[k * 2 + 1] = shotX[k * 2] + RandomIn(-0.1, 0.1);
+        shotY[k * 2 + 1] = shotY[k * 2] + RandomIn(-0.1, 0.1);
+    }
+    printf("%d shots against %d targets, %d rounds\n", shots, targets, iterations);
+    
+    NarrowphaseKernelEntry kernels[4];
+    int count = AvailableNarrowphaseKernels(kernels);
+    double scalarSeconds = 0;
+    for (int j = 0; j < count; j++) {
+        long hits = 0;
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        for (int k = 0; k < iterations; k++) {
+            for (int shot = 0; shot < shots; shot++) {
+                kernels[j].kernel(shotX[shot * 2], shotY[shot * 2], shotX[shot * 2 + 1], shotY[shot * 2 + 1],
+                                  &fromX[0], &fromY[0], &toX[0], &toY[0], targets, radius2, &masks[0]);
+                for (size_t w = 0; w < masks.size(); w++) hits += __builtin_popcount(masks[w]);
+            }
+        }
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        if (j == 0) scalarSeconds = seconds;
+        printf("narrowphase %-8s %6.3f ns per test (%.2fx), %ld hits%s\n", kernels[j].name, seconds * 1e9 / ((double)targets * shots * iterations),
+               scalarSeconds / seconds, hits, kernels[j].kernel == narrowphaseKernel.kernel ? ", in use" : "");
+    }
+}
+
+// headless driver: steps the simulation for a number of ticks with scripted
+// input and reports throughput, no window or GPU needed
+int main(int argc, char * argv[])
+{
+    int ticks = 10000;
+    double dt = 1.0 / 60;
+    double tickRate = 60;
+    bool draw = false;
+    const char* bench = 0;
+    const char* check = 0;
+    std::vector<ScriptedInput> script = DefaultScript();
+    
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--ticks") == 0 && i + 1 < argc) ticks = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--dt") == 0 && i + 1 < argc) dt = atof(argv[++i]);
+        else if (strcmp(argv[i], "--tick-rate") == 0 && i + 1 < argc) tickRate = atof(argv[++i]);
+        else if (strcmp(argv[i], "--draw") == 0) draw = true;
+        else if (strcmp(argv[i], "--grid") == 0 && i + 1 < argc) asteroidGridSize = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) jobThreads = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--holes") == 0 && i + 1 < argc) blackHoleCount = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--theta") == 0 && i + 1 < argc) gravityTheta = atof(argv[++i]);
+        else if (strcmp(argv[i], "--field") == 0 && i + 1 < argc) gravityFieldCells = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--bench") == 0 && i + 1 < argc) bench = argv[++i];
+        else if (strcmp(argv[i], "--check") == 0 && i + 1 < argc) check = argv[++i];
+        else if (strcmp(argv[i], "--pools") == 0 && i + 1 < argc) {
+            if (sscanf(argv[++i], "%d,%d,%d", &poolCaps.projectiles, &poolCaps.fireballs, &poolCaps.explosions) != 3) { printf("--pools takes projectiles,fireballs,explosions\n"); return 1; }
+        }
+        else if (strcmp(argv[i], "--script") == 0 && i + 1 < argc) {
+            script.clear();
+            if (!LoadScript(argv[++i], script)) { printf("cannot read script %s\n", argv[i]); return 1; }
+        }
+        else {
+            printf("usage: %s [--ticks N] [--dt seconds] [--tick-rate Hz] [--draw] [--grid N] [--threads N] [--holes N] [--theta X] [--field N] [--script file] [--pools P,F,E] [--bench soa|transform|gravity|narrowphase] [--check narrowphase]\n", argv[0]);
+            return 1;
+        }
+    }
+    
+    if (bench) {
+        if (strcmp(bench, "soa") == 0) BenchmarkEntityLayouts(20000, ticks / 10 > 0 ? ticks / 10 : 1);
+        else if (strcmp(bench, "transform") == 0) BenchmarkTransforms(10000, ticks / 10 > 0 ? ticks / 10 : 1);
+        else if (strcmp(bench, "gravity") == 0) BenchmarkGravity(200000, blackHoleCount > 1 ? blackHoleCount : 64, ticks / 1000 > 0 ? ticks / 1000 : 1);
+        else if (strcmp(bench, "narrowphase") == 0) BenchmarkNarrowphase(4096, 1000, ticks / 100 > 0 ? ticks / 100 : 1);
+        else { printf("unknown benchmark %s\n", bench); return 1; }
+        return 0;
+    }
+    if (check) {
+        if (strcmp(check, "narrowphase") == 0) return CheckNarrowphase(ticks) > 0 ? 1 : 0;
+        printf("unknown check %s\n", check);
+        return 1;
+    }
+    
+    onInitialization();
+    timestep.SetTickRate(tickRate);
+    
+    // each iteration is one frame of dt seconds, which runs however many
+    // fixed ticks it covers
+    int tick = 0, frames = 0, applied = -1;
+    size_t allocationsBefore = heapAllocations.load(std::memory_order_relaxed);
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    while (tick < ticks) {
+        ApplyScript(script, applied + 1, tick);
+        applied = tick;
+        tick += AdvanceFrame(dt);
+        frames++;
+        if (draw) onDisplay();
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    size_t allocations = heapAllocations.load(std::memory_order_relaxed) - allocationsBefore;
+    
+    printf("%d ticks (%d frames) in %.3f s: %.0f ticks per second\n", tick, frames, seconds, tick / seconds);
+    printf("%zu heap allocations (%.2f per tick)\n", allocations, (float)allocations / tick);
+    if (draw) {
+        printf("%d draw calls (%.1f per frame)\n", nullDrawCalls, (float)nullDrawCalls / frames);
+        printf("state changes per frame: %.1f issued, %.1f elided, %d and %d in the last frame\n", (float)renderState.IssuedTotal() / frames,
+               (float)renderState.ElidedTotal() / frames, renderState.IssuedLastFrame(), renderState.ElidedLastFrame());
+        printf("transforms recomputed per frame: %.1f, %d of %d in the last frame\n", (float)entities.TransformsRecomputedTotal() / frames,
+               entities.TransformsRecomputedLastFrame(), entities.Size());
+        printf("asteroid layer rebuilt in %d of %d frames\n", gScene->AsteroidLayerRebuilds(), frames);
+    }
+    printf("%d vertex arrays in total\n", vertexArrayCount);
+    printf("%d job threads, %d chunks stolen\n", jobs.Threads(), jobs.Steals());
+    if (gravityFieldCells > 0) gScene->PrintGravityFieldStats();
+    gScene->PrintPoolStats();
+    
+    onExit();
+    return 0;
+}
+
+#else
+
 int main(int argc, char * argv[])
 {
     glutInit(&argc, argv);
@@ -1732,6 +4338,7 @@ int main(int argc, char * argv[])
     onInitialization();
     
     glutDisplayFunc(onDisplay); // register event handlers
+    glutReshapeFunc(onReshape);
     glutMouseFunc(onMouse);
     glutMotionFunc(onMouseDrag);
     glutKeyboardFunc(onKeyboard);
@@ -1742,3 +4349,5 @@ int main(int argc, char * argv[])
     onExit();
     return 1;
 }
+
+#endif
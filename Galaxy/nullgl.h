@@ -0,0 +1,137 @@
+//
+//  nullgl.h
+//  Galaxy
+//
+//  Null renderer for headless builds (-DGALAXY_HEADLESS). Every GL and GLUT
+//  entry point main.cpp uses compiles to a no-op, so the game logic runs
+//  without a window, a GL context or a GPU. Object names are handed out from
+//  a counter so code that checks for a non-zero id keeps working.
+//
+
+#ifndef nullgl_h
+#define nullgl_h
+
+#include <stddef.h>
+
+enum {
+    GL_FALSE = 0,
+    GL_TRUE = 1,
+    GL_TRIANGLES = 0x0004,
+    GL_TRIANGLE_STRIP = 0x0005,
+    GL_SRC_ALPHA = 0x0302,
+    GL_ONE_MINUS_SRC_ALPHA = 0x0303,
+    GL_BLEND = 0x0BE2,
+    GL_TEXTURE_2D = 0x0DE1,
+    GL_UNSIGNED_BYTE = 0x1401,
+    GL_FLOAT = 0x1406,
+    GL_RGBA = 0x1908,
+    GL_VENDOR = 0x1F00,
+    GL_RENDERER = 0x1F01,
+    GL_VERSION = 0x1F02,
+    GL_NEAREST = 0x2600,
+    GL_LINEAR = 0x2601,
+    GL_TEXTURE_MAG_FILTER = 0x2800,
+    GL_TEXTURE_MIN_FILTER = 0x2801,
+    GL_DEPTH_BUFFER_BIT = 0x0100,
+    GL_COLOR_BUFFER_BIT = 0x4000,
+    GL_ONE = 1,
+    GL_TEXTURE0 = 0x84C0,
+    GL_ARRAY_BUFFER = 0x8892,
+    GL_STREAM_DRAW = 0x88E0,
+    GL_STATIC_DRAW = 0x88E4,
+    GL_UNIFORM_BUFFER = 0x8A11,
+    GL_DYNAMIC_DRAW = 0x88E8,
+    GL_FRAGMENT_SHADER = 0x8B30,
+    GL_VERTEX_SHADER = 0x8B31,
+    GL_COMPILE_STATUS = 0x8B81,
+    GL_LINK_STATUS = 0x8B82,
+    GL_INFO_LOG_LENGTH = 0x8B84,
+    GL_SHADING_LANGUAGE_VERSION = 0x8B8C,
+    GL_FRAMEBUFFER_COMPLETE = 0x8CD5,
+    GL_COLOR_ATTACHMENT0 = 0x8CE0,
+    GL_FRAMEBUFFER = 0x8D40,
+    GL_MAJOR_VERSION = 0x821B,
+    GL_MINOR_VERSION = 0x821C,
+};
+
+static const unsigned int GL_INVALID_INDEX = 0xFFFFFFFFu;
+
+enum {
+    GLUT_DOWN = 0,
+    GLUT_UP = 1,
+    GLUT_ELAPSED_TIME = 700,
+};
+
+// draw calls the null renderer swallowed, so headless runs can report them
+static int nullDrawCalls = 0;
+static unsigned int nullNextName = 1;
+
+inline void nullGenNames(int n, unsigned int* names) { for (int i = 0; i < n; i++) names[i] = nullNextName++; }
+
+// objects
+inline void glGenVertexArrays(int n, unsigned int* arrays) { nullGenNames(n, arrays); }
+inline void glGenBuffers(int n, unsigned int* buffers) { nullGenNames(n, buffers); }
+inline void glGenTextures(int n, unsigned int* textures) { nullGenNames(n, textures); }
+inline void glGenFramebuffers(int n, unsigned int* framebuffers) { nullGenNames(n, framebuffers); }
+inline void glDeleteVertexArrays(int, const unsigned int*) {}
+inline void glDeleteBuffers(int, const unsigned int*) {}
+inline void glDeleteTextures(int, const unsigned int*) {}
+inline void glDeleteFramebuffers(int, const unsigned int*) {}
+inline void glBindVertexArray(unsigned int) {}
+inline void glBindBuffer(unsigned int, unsigned int) {}
+inline void glBindBufferBase(unsigned int, unsigned int, unsigned int) {}
+inline void glBindTexture(unsigned int, unsigned int) {}
+inline void glBindFramebuffer(unsigned int, unsigned int) {}
+inline void glFramebufferTexture2D(unsigned int, unsigned int, unsigned int, unsigned int, int) {}
+inline unsigned int glCheckFramebufferStatus(unsigned int) { return GL_FRAMEBUFFER_COMPLETE; }
+inline void glActiveTexture(unsigned int) {}
+inline void glBufferData(unsigned int, ptrdiff_t, const void*, unsigned int) {}
+inline void glBufferSubData(unsigned int, ptrdiff_t, ptrdiff_t, const void*) {}
+inline void glEnableVertexAttribArray(unsigned int) {}
+inline void glVertexAttribPointer(unsigned int, int, unsigned int, unsigned char, int, const void*) {}
+inline void glVertexAttribDivisor(unsigned int, unsigned int) {}
+inline void glTexImage2D(unsigned int, int, int, int, int, int, unsigned int, unsigned int, const void*) {}
+inline void glTexParameteri(unsigned int, unsigned int, int) {}
+
+// shaders
+inline unsigned int glCreateShader(unsigned int) { return nullNextName++; }
+inline unsigned int glCreateProgram() { return nullNextName++; }
+inline void glShaderSource(unsigned int, int, const char* const*, const int*) {}
+inline void glCompileShader(unsigned int) {}
+inline void glAttachShader(unsigned int, unsigned int) {}
+inline void glLinkProgram(unsigned int) {}
+inline void glDeleteProgram(unsigned int) {}
+inline void glUseProgram(unsigned int) {}
+inline void glBindAttribLocation(unsigned int, unsigned int, const char*) {}
+inline void glBindFragDataLocation(unsigned int, unsigned int, const char*) {}
+inline void glGetShaderiv(unsigned int, unsigned int pname, int* params) { *params = (pname == GL_INFO_LOG_LENGTH) ? 0 : GL_TRUE; }
+inline void glGetProgramiv(unsigned int, unsigned int, int* params) { *params = GL_TRUE; }
+inline void glGetShaderInfoLog(unsigned int, int, int* length, char* log) { *length = 0; if (log) log[0] = 0; }
+inline int glGetUniformLocation(unsigned int, const char*) { return 0; }
+inline unsigned int glGetUniformBlockIndex(unsigned int, const char*) { return 0; }
+inline void glUniformBlockBinding(unsigned int, unsigned int, unsigned int) {}
+inline void glUniform1i(int, int) {}
+inline void glUniform2fv(int, int, const float*) {}
+inline void glUniform3fv(int, int, const float*) {}
+inline void glUniform4fv(int, int, const float*) {}
+inline void glUniformMatrix4fv(int, int, unsigned char, const float*) {}
+
+// state and drawing
+inline void glViewport(int, int, int, int) {}
+inline void glEnable(unsigned int) {}
+inline void glDisable(unsigned int) {}
+inline void glBlendFunc(unsigned int, unsigned int) {}
+inline void glBlendFuncSeparate(unsigned int, unsigned int, unsigned int, unsigned int) {}
+inline void glClearColor(float, float, float, float) {}
+inline void glClear(unsigned int) {}
+inline void glDrawArrays(unsigned int, int, int) { nullDrawCalls++; }
+inline void glDrawArraysInstanced(unsigned int, int, int, int) { nullDrawCalls++; }
+inline const unsigned char* glGetString(unsigned int) { return (const unsigned char*)"null"; }
+inline void glGetIntegerv(unsigned int, int* data) { *data = 0; }
+
+// GLUT
+inline void glutPostRedisplay() {}
+inline void glutSwapBuffers() {}
+inline int glutGet(unsigned int) { return 0; }
+
+#endif /* nullgl_h */